@@ -0,0 +1,98 @@
+/* 
+  ArbotiX Firmware for ROS driver - Background Analog Sampling
+  Copyright (c) 2009-2011 Vanadium Labs LLC.  All right reserved.
+ 
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of Vanadium Labs LLC nor the names of its 
+        contributors may be used to endorse or promote products derived 
+        from this software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL VANADIUM LABS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+  OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#include <Arduino.h>
+
+/*
+ * The ADC converts channels 0 to ADC_CHANNELS-1 in turn, from its own
+ *  interrupt. Each channel accumulates 4^ADC_OVERSAMPLE_BITS conversions,
+ *  which decimate to a reading with ADC_OVERSAMPLE_BITS more bits than the
+ *  hardware's 10. Readings are stamped with millis() when they complete.
+ *
+ * While the sampler runs it owns the ADC: use adcRead(), not analogRead().
+ */
+#define ADC_CHANNELS          8
+#define ADC_OVERSAMPLE_BITS   2
+#define ADC_SAMPLES           (1<<(2*ADC_OVERSAMPLE_BITS))   // 16
+#define ADC_BITS              (10+ADC_OVERSAMPLE_BITS)
+
+volatile unsigned int adc_values[ADC_CHANNELS];     // last decimated reading
+volatile unsigned long adc_times[ADC_CHANNELS];     // millis() at that reading
+unsigned long adc_sum;                              // conversions of the current channel
+unsigned char adc_count;
+unsigned char adc_channel;
+
+/* start converting, ADC_CHANNELS*(ADC_SAMPLES+1) conversions per round */
+void adcBegin(){
+  adc_sum = 0;
+  adc_count = 0;
+  adc_channel = 0;
+  ADMUX = (1<<REFS0);                     // AVcc reference, as analogRead()
+  ADCSRA |= (1<<ADEN)|(1<<ADIE)|(1<<ADSC);
+}
+
+void adcStop(){
+  ADCSRA &= ~(1<<ADIE);
+}
+
+ISR(ADC_vect){
+  unsigned char l = ADCL;                 // ADCL must be read first
+  unsigned int x = (ADCH<<8) | l;
+  // the first conversion after switching channels is thrown away, the
+  //  sample and hold may not have settled on a high impedance source
+  if(adc_count++ > 0)
+    adc_sum += x;
+  if(adc_count > ADC_SAMPLES){
+    adc_values[adc_channel] = adc_sum >> ADC_OVERSAMPLE_BITS;
+    adc_times[adc_channel] = millis();
+    adc_sum = 0;
+    adc_count = 0;
+    if(++adc_channel >= ADC_CHANNELS)
+      adc_channel = 0;
+    ADMUX = (1<<REFS0) | adc_channel;
+  }
+  ADCSRA |= (1<<ADSC);
+}
+
+/* latest reading of a channel, ADC_BITS wide */
+unsigned int adcRead(unsigned char channel){
+  unsigned char oldSREG = SREG;
+  cli();
+  unsigned int x = adc_values[channel];
+  SREG = oldSREG;
+  return x;
+}
+
+/* millis() when a channel's latest reading completed */
+unsigned long adcTime(unsigned char channel){
+  unsigned char oldSREG = SREG;
+  cli();
+  unsigned long t = adc_times[channel];
+  SREG = oldSREG;
+  return t;
+}
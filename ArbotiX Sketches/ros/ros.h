@@ -36,8 +36,32 @@
 #define ARB_CONTROL_SETUP   26   // write ids: id of controller, params (usually ids of servos, # of params = pose_size + 1)
 #define ARB_CONTROL_WRITE   27   // write positions: positions in order of servos (# of params = 2*pose_size)
 #define ARB_CONTROL_STAT    28   // retrieve status: id of controller
+#define ARB_CONTROL_QUEUE   29   // queue setpoint: id of controller, positions (2*pose_size), time in ms (2 bytes)
+#define ARB_STORE_COMMIT    30   // keep poses and sequence in EEPROM across a reset: flags (STORE_AUTOPLAY)
+#define ARB_STORE_LOAD      31   // reload poses and sequence from EEPROM: no params
+#define ARB_CONTROL_RESYNC  32   // read a controller's pose back from its servos: id of controller
+#define ARB_SUBSCRIBE       33   // push telemetry: period in ms (2 bytes, 0 = stop), then type/arg pairs
+#define ARB_HALT_SEQ        34   // stop the sequence where it is: no params
+#define ARB_SEQ_STATUS      35   // sequence status: no params, returns state (SEQ_*) and step
 #define ARB_SYNC_READ       0x84
 
+/* Sequence playback states (ARB_SEQ_STATUS) */
+#define SEQ_IDLE            0
+#define SEQ_PLAY            1    // play once, ARB_PLAY_SEQ
+#define SEQ_LOOP            2    // play until halted, ARB_LOOP_SEQ
+
+/* Telemetry (ARB_SUBSCRIBE) item types, and what each adds to a frame */
+#define TLM_REGISTER        0    // arg = ArbotiX register, 1 byte
+#define TLM_SERVO           1    // arg = servo id, present position read from the bus, 2 bytes (0xffff = no answer)
+#define TLM_POSE            2    // arg = servo id, current pose of its controller, 2 bytes
+#define TLM_CONTROLLER      3    // arg = controller, interpolating, 1 byte
+#define TLM_ENCODERS        4    // left then right encoder, 8 bytes (USE_BASE)
+#define TLM_MAX_ITEMS       16
+#define TLM_MAX_BYTES       64
+/* telemetry frames are sent from id 253 with this in place of the error, 
+   servos never set bit 7 of the error */
+#define TLM_ERROR           0x80
+
 /* ArbotiX (id:253) Register Table Definitions */
 #define REG_MODEL_NUMBER_L  0
 #define REG_MODEL_NUMBER_H  1
@@ -63,14 +87,117 @@
 #define REG_RESERVED        79  // 79 -- 99 are reserved for future use
 #define REG_USER            100 // 
 
-/* Packet Decoding */
-int mode = 0;                   // where we are in the frame
+/* Register Descriptors, one per address below REG_RESERVED. The type tells 
+   handleRead()/handleWrite() what to do with an address, arg is a constant 
+   value, port, channel or pin. Addresses that are not readable are passed to 
+   userRead(), addresses from REG_RESERVED up go to the user hooks. */
+typedef struct{
+  unsigned char type;           // RT_* type, plus access flags
+  unsigned char arg;            // depends on type
+} reg_desc_t;
+
+#define RT_R                0x80  // readable
+#define RT_W                0x40  // writable
+#define RT_TYPE             0x3F
+
+#define RT_NONE             0
+#define RT_CONST            (1|RT_R)  // reads as arg
+#define RT_BAUD             2     // writes UBRR1L, reads as arg
+#define RT_DIGITAL_IN       3     // a port of 8 digital inputs
+#define RT_RESCAN           4     // any write rescans the bus
+#define RT_RETURN_LEVEL     5
+#define RT_ALARM_LED        6
+#define RT_ANALOG           7     // 8-bit reading of analog channel arg
+#define RT_SERVO            8     // byte arg of the servo pulse widths
+#define RT_DIGITAL_OUT      9     // pin arg, bit 1 = value, bit 0 = direction
+
+const reg_desc_t reg_table[REG_RESERVED] PROGMEM = {
+  {RT_CONST, 44},                   // 0: REG_MODEL_NUMBER_L
+  {RT_CONST, 1},                    // 1: REG_MODEL_NUMBER_H, model 300
+  {RT_CONST, 0},                    // 2: REG_VERSION
+  {RT_CONST, 253},                  // 3: REG_ID
+  {RT_BAUD|RT_R|RT_W, 34},          // 4: REG_BAUD_RATE, reads as 56700
+  {RT_DIGITAL_IN|RT_R, 0},          // 5: REG_DIGITAL_IN0
+  {RT_DIGITAL_IN|RT_R, 1},
+  {RT_DIGITAL_IN|RT_R, 2},
+  {RT_DIGITAL_IN|RT_R, 3},
+  {RT_NONE, 0},
+  {RT_NONE, 0},
+  {RT_NONE, 0},
+  {RT_NONE, 0},
+  {RT_NONE, 0},
+  {RT_NONE, 0},
+  {RT_RESCAN|RT_W, 0},              // 15: REG_RESCAN
+  {RT_RETURN_LEVEL|RT_R|RT_W, 0},   // 16: REG_RETURN_LEVEL
+  {RT_ALARM_LED|RT_R|RT_W, 0},      // 17: REG_ALARM_LED
+  {RT_ANALOG|RT_R, 0},              // 18: REG_ANA_BASE
+  {RT_ANALOG|RT_R, 1},
+  {RT_ANALOG|RT_R, 2},
+  {RT_ANALOG|RT_R, 3},
+  {RT_ANALOG|RT_R, 4},
+  {RT_ANALOG|RT_R, 5},
+  {RT_ANALOG|RT_R, 6},
+  {RT_ANALOG|RT_R, 7},
+  {RT_SERVO|RT_R|RT_W, 0},          // 26: REG_SERVO_BASE
+  {RT_SERVO|RT_R|RT_W, 1},
+  {RT_SERVO|RT_R|RT_W, 2},
+  {RT_SERVO|RT_R|RT_W, 3},
+  {RT_SERVO|RT_R|RT_W, 4},
+  {RT_SERVO|RT_R|RT_W, 5},
+  {RT_SERVO|RT_R|RT_W, 6},
+  {RT_SERVO|RT_R|RT_W, 7},
+  {RT_SERVO|RT_R|RT_W, 8},
+  {RT_SERVO|RT_R|RT_W, 9},
+  {RT_SERVO|RT_R|RT_W, 10},
+  {RT_SERVO|RT_R|RT_W, 11},
+  {RT_SERVO|RT_R|RT_W, 12},
+  {RT_SERVO|RT_R|RT_W, 13},
+  {RT_SERVO|RT_R|RT_W, 14},
+  {RT_SERVO|RT_R|RT_W, 15},
+  {RT_SERVO|RT_R|RT_W, 16},
+  {RT_SERVO|RT_R|RT_W, 17},
+  {RT_SERVO|RT_R|RT_W, 18},
+  {RT_SERVO|RT_R|RT_W, 19},
+  {RT_NONE, 0},                     // 46: REG_MOVING
+  {RT_DIGITAL_OUT|RT_W, 0},         // 47: REG_DIGITAL_OUT0
+  {RT_DIGITAL_OUT|RT_W, 1},
+  {RT_DIGITAL_OUT|RT_W, 2},
+  {RT_DIGITAL_OUT|RT_W, 3},
+  {RT_DIGITAL_OUT|RT_W, 4},
+  {RT_DIGITAL_OUT|RT_W, 5},
+  {RT_DIGITAL_OUT|RT_W, 6},
+  {RT_DIGITAL_OUT|RT_W, 7},
+  {RT_DIGITAL_OUT|RT_W, 8},
+  {RT_DIGITAL_OUT|RT_W, 9},
+  {RT_DIGITAL_OUT|RT_W, 10},
+  {RT_DIGITAL_OUT|RT_W, 11},
+  {RT_DIGITAL_OUT|RT_W, 12},
+  {RT_DIGITAL_OUT|RT_W, 13},
+  {RT_DIGITAL_OUT|RT_W, 14},
+  {RT_DIGITAL_OUT|RT_W, 15},
+  {RT_DIGITAL_OUT|RT_W, 16},
+  {RT_DIGITAL_OUT|RT_W, 17},
+  {RT_DIGITAL_OUT|RT_W, 18},
+  {RT_DIGITAL_OUT|RT_W, 19},
+  {RT_DIGITAL_OUT|RT_W, 20},
+  {RT_DIGITAL_OUT|RT_W, 21},
+  {RT_DIGITAL_OUT|RT_W, 22},
+  {RT_DIGITAL_OUT|RT_W, 23},
+  {RT_DIGITAL_OUT|RT_W, 24},
+  {RT_DIGITAL_OUT|RT_W, 25},
+  {RT_DIGITAL_OUT|RT_W, 26},
+  {RT_DIGITAL_OUT|RT_W, 27},
+  {RT_DIGITAL_OUT|RT_W, 28},
+  {RT_DIGITAL_OUT|RT_W, 29},
+  {RT_DIGITAL_OUT|RT_W, 30},
+  {RT_DIGITAL_OUT|RT_W, 31},
+};
 
+/* Packet Decoding, the current packet from the PacketParser */
 unsigned char id = 0;           // id of this frame
 unsigned char length = 0;       // length of this frame
 unsigned char ins = 0;          // instruction of this frame
 
-unsigned char params[143];      // parameters (match RX-64 buffer size)
-unsigned char index = 0;        // index in param buffer
+unsigned char * params;         // parameters, in the parser's buffer
 
 int checksum;                   // checksum
@@ -29,12 +29,34 @@
 /* Build Configuration */
 #define USE_BASE            // Enable support for a mobile base
 #define USE_HW_SERVOS       // Enable only 2/8 servos, but using hardware control
+#define USE_QUEUE           // Enable timestamped setpoint queues for the controllers
+#define USE_ADC_SAMPLER     // Sample analog inputs in the background, user code must use adcRead()
 
 #define CONTROLLER_COUNT    5
+#define CONTROLLER_SERVOS   12  // most servos in one controller, storage is fixed at build time
 /* Hardware Constructs */
 #include <ax12.h>
 #include <BioloidController.h>
-BioloidController controllers[CONTROLLER_COUNT];
+#include <BioloidGroup.h>
+#include <BioloidStore.h>
+#include <PacketParser.h>
+#include <TaskLoop.h>
+StaticBioloidController<CONTROLLER_SERVOS> controllers[CONTROLLER_COUNT];
+BioloidGroup group;             // steps all controllers with one sync write per frame
+PacketParser parser;            // frames packets from the host
+unsigned char synced[CONTROLLER_COUNT]; // has the controller's pose been read from the servos?
+
+#define TASK_COUNT          8   // ours, and room for userSetup() to add its own
+TaskLoop tasks;                 // runs the pieces of loop() by priority, keeps their timing
+task_t task_storage[TASK_COUNT];
+int tlm_task;                   // its period follows ARB_SUBSCRIBE
+
+#ifdef USE_QUEUE
+  #define QUEUE_DEPTH       4   // setpoints per controller
+  #define QUEUE_SERVOS      8   // largest controller that can be streamed to
+  unsigned int queue_poses[CONTROLLER_COUNT][QUEUE_DEPTH*QUEUE_SERVOS];
+  unsigned long queue_times[CONTROLLER_COUNT][QUEUE_DEPTH];
+#endif
 
 #include "ros.h"
 
@@ -55,19 +77,19 @@ BioloidController controllers[CONTROLLER_COUNT];
   #include "diff_controller.h"
 #endif
 
+#ifdef USE_ADC_SAMPLER
+  #include "adc_sampler.h"
+#endif
+
 /* Register Storage */
 unsigned char baud = 7;         // ?
 unsigned char ret_level = 1;    // ?
 unsigned char alarm_led = 0;    // ?
 
-/* Pose & Sequence Structures */
-typedef struct{
-  unsigned char pose;           // index of pose to transition to 
-  int time;                     // time for transition
-} sp_trans_t;
-int poses[30][AX12_MAX_SERVOS]; // poses [index][servo_id-1]
-sp_trans_t sequence[50];        // sequence
+/* Pose & Sequence Storage, kept in EEPROM */
+BioloidStore store;
 int seqPos;                     // step in current sequence
+unsigned char seqState = SEQ_IDLE;
 
 #include "user_hooks.h"
 
@@ -102,8 +124,42 @@ void setup(){
   scan();
 #endif
 
+  for(int i=0; i<CONTROLLER_COUNT; i++){
+    group.add(&controllers[i]);
+#ifdef USE_QUEUE
+    controllers[i].setQueue(queue_poses[i], queue_times[i], QUEUE_DEPTH, QUEUE_SERVOS);
+#endif
+  }
+
+  // budgets are rough, overruns and missed deadlines show up in task_storage
+  tasks.begin(task_storage, TASK_COUNT);
+  tasks.add(readHost, 0, 2000, 3);
+  tasks.add(updateJoints, BIOLOID_FRAME_LENGTH, 2000, 2);
+#ifdef USE_BASE
+  tasks.add(updatePID, 0, 500, 1);
+#endif
+  tlm_task = tasks.add(pushTelemetry, 0, 2000, 0);
+
   userSetup();
   pinMode(0,OUTPUT);     // status LED
+
+#ifdef USE_ADC_SAMPLER
+  adcBegin();
+#endif
+
+  // pick up the poses and sequence the host committed before the reset
+  if(loadStore() && (store.getFlags() & STORE_AUTOPLAY))
+    startSeq(SEQ_PLAY);
+}
+
+/* size controller 0 for the stored poses, returns 0 if nothing is stored */
+int loadStore(){
+  unsigned char size = store.load();
+  if((size == 0) || (size > controllers[0].capacity())) return 0;
+  controllers[0].poseSize = size;
+  controllers[0].readPose();
+  synced[0] = 1;
+  return 1;
 }
 
 /*
@@ -115,73 +171,84 @@ unsigned char handleWrite(){
   int k = 1;              // index in parameters of value to write
 
   while(bytes > 0){
-    if(addr < REG_BAUD_RATE){
-      return ERR_INSTRUCTION;
-    }else if(addr == REG_BAUD_RATE){
-      UBRR1L = params[k];
-    }else if(addr < REG_RESCAN){
-      return ERR_INSTRUCTION; // can't write digital inputs
-    }else if(addr == REG_RESCAN){
-      scan();
-    }else if(addr == REG_RETURN_LEVEL){
-      ret_level = params[k];
-    }else if(addr == REG_ALARM_LED){
-      // TODO: 
-    }else if(addr < REG_SERVO_BASE){
-      return ERR_INSTRUCTION; // error - analog are read only
-    }else if(addr < REG_MOVING){
-      // write servo
-      int s = addr - REG_SERVO_BASE;
- #ifdef USE_HW_SERVO
-      if( s >= 4 ){
- #else
-      if( s >= 20){
- #endif 
-        return ERR_INSTRUCTION;
-      }else{
-        if( s%2 == 0 ){ // low byte
-          s = s/2;
-          servo_vals[s] = params[k];
-        }else{          // high byte
-          s = s/2;
-          servo_vals[s] += (params[k]<<8);
-          if(servo_vals[s] > 500 && servo_vals[s] < 2500){
-            servos[s].writeMicroseconds(servo_vals[s]);
-            if(!servos[s].attached())            
-              servos[s].attach(s);
-          }else if(servo_vals[s] == 0){
-            servos[s].detach();
-          }
-        }
-      }
-    }else if(addr == REG_MOVING){
-      return ERR_INSTRUCTION;
-    }else if(addr < REG_RESERVED){
-      // write digital pin
-      int pin = addr - REG_DIGITAL_OUT0;
-    #ifdef SERVO_STIK
-      if(pin < 8)
-        pin = pin+24;
-      else
-        pin = pin+5; // servo stick 8 = D13...
-    #endif
-      if(params[k] & 0x02)    // high
-        digitalWrite(pin, HIGH);
-      else
-        digitalWrite(pin, LOW);
-      if(params[k] & 0x01)    // output
-        pinMode(pin, OUTPUT);
-      else
-        pinMode(pin, INPUT);
-    }else{
+    if(addr >= REG_RESERVED){
       int ret = userWrite(addr, params[k]);
       if(ret > ERR_NONE) return ret;
+    }else{
+      unsigned char type = pgm_read_byte(&reg_table[addr].type);
+      unsigned char arg = pgm_read_byte(&reg_table[addr].arg);
+      if(!(type & RT_W))
+        return ERR_INSTRUCTION;   // read only
+      switch(type & RT_TYPE){
+        case RT_BAUD:
+          UBRR1L = params[k];
+          break;
+        case RT_RESCAN:
+          scan();
+          break;
+        case RT_RETURN_LEVEL:
+          ret_level = params[k];
+          break;
+        case RT_ALARM_LED:
+          alarm_led = params[k];  // TODO: drive the LED
+          break;
+        case RT_SERVO:
+          if(!writeServo(arg, params[k]))
+            return ERR_INSTRUCTION;
+          break;
+        case RT_DIGITAL_OUT:
+          writeDigital(arg, params[k]);
+          break;
+      }
     }
     addr++;k++;bytes--;
   }
   return ERR_NONE;
 }
 
+/* write byte S of the servo pulse widths, the servo is updated on the high byte */
+int writeServo(int s, unsigned char v){
+#ifdef USE_HW_SERVOS
+  if( s >= 4 )
+#else
+  if( s >= 20 )
+#endif 
+    return 0;
+  if( s%2 == 0 ){ // low byte
+    s = s/2;
+    servo_vals[s] = v;
+  }else{          // high byte
+    s = s/2;
+    servo_vals[s] += (v<<8);
+    if(servo_vals[s] > 500 && servo_vals[s] < 2500){
+      servos[s].writeMicroseconds(servo_vals[s]);
+      if(!servos[s].attached())            
+        servos[s].attach(s);
+    }else if(servo_vals[s] == 0){
+      servos[s].detach();
+    }
+  }
+  return 1;
+}
+
+/* write a digital pin, bit 1 = value, bit 0 = direction */
+void writeDigital(int pin, unsigned char v){
+#ifdef SERVO_STIK
+  if(pin < 8)
+    pin = pin+24;
+  else
+    pin = pin+5; // servo stick 8 = D13...
+#endif
+  if(v & 0x02)    // high
+    digitalWrite(pin, HIGH);
+  else
+    digitalWrite(pin, LOW);
+  if(v & 0x01)    // output
+    pinMode(pin, OUTPUT);
+  else
+    pinMode(pin, INPUT);
+}
+
 
 /*
  * Handle a read from ArbotiX registers.
@@ -193,77 +260,214 @@ int handleRead(){
   
   unsigned char v;
   while(bytes > 0){
-    if(addr == REG_MODEL_NUMBER_L){ 
-      v = 44;
-    }else if(addr == REG_MODEL_NUMBER_H){
-      v = 1;  // 300 
-    }else if(addr == REG_VERSION){
-      v = 0;
-    }else if(addr == REG_ID){
-      v = 253;
-    }else if(addr == REG_BAUD_RATE){
-      v = 34; // 56700
-    }else if(addr == REG_DIGITAL_IN0){
-      // digital 0-7
+    v = readRegister(addr);
+    checksum += v;
+    Serial.write(v);
+    addr++;bytes--;
+  }
+  
+  return checksum;
+}
+
+/* value of one ArbotiX register */
+unsigned char readRegister(int addr){
+  unsigned char type = RT_NONE;
+  unsigned char arg = 0;
+  if(addr < REG_RESERVED){
+    type = pgm_read_byte(&reg_table[addr].type);
+    arg = pgm_read_byte(&reg_table[addr].arg);
+  }
+  if(!(type & RT_R))
+    return userRead(addr);
+  switch(type & RT_TYPE){
+    case RT_DIGITAL_IN:
+      return readDigital(arg);
+    case RT_RETURN_LEVEL:
+      return ret_level;
+    case RT_ALARM_LED:
+      return alarm_led;
+    case RT_ANALOG:
+#ifdef USE_ADC_SAMPLER
+      // latest background reading
+      return adcRead(arg)>>(ADC_BITS-8);
+#else
+      {
+        // send analog reading
+        int x = analogRead(arg)>>2;
+        x += analogRead(arg)>>2;
+        x += analogRead(arg)>>2;
+        x += analogRead(arg)>>2;
+        return x/4;
+      }
+#endif
+    case RT_SERVO:
+      // send servo position
+      return 0;
+    default:    // RT_CONST, RT_BAUD
+      return arg;
+  }
+}
+
+/* read a port of 8 digital inputs */
+unsigned char readDigital(int port){
+  switch(port){
+    case 0:   // digital 0-7
     #ifdef SERVO_STIK
-      v = PINA;
+      return PINA;
     #else
-      v = PINB;
+      return PINB;
     #endif
-    }else if(addr == REG_DIGITAL_IN1){
-      // digital 8-15
+    case 1:   // digital 8-15
     #ifdef SERVO_STIK
-      v = (PINB>>1);
+      return (PINB>>1);
     #else
-      v = PIND;
+      return PIND;
     #endif        
-    }else if(addr == REG_DIGITAL_IN2){
-      // digital 16-23
-      v = PINC;
-    }else if(addr == REG_DIGITAL_IN3){
-      // digital 24-31
-      v = PINA;
-    }else if(addr == REG_RETURN_LEVEL){
-      v = ret_level;
-    }else if(addr == REG_ALARM_LED){
-      // TODO
-    }else if(addr < REG_SERVO_BASE){
-      // send analog reading
-      int x = analogRead(addr-REG_ANA_BASE)>>2;
-      x += analogRead(addr-REG_ANA_BASE)>>2;
-      x += analogRead(addr-REG_ANA_BASE)>>2;
-      x += analogRead(addr-REG_ANA_BASE)>>2;
-      v = x/4;
-    }else if(addr < REG_MOVING){
-      // send servo position
-      v = 0;      
-    }else{
-      v = userRead(addr);  
-    } 
-    checksum += v;
-    Serial.write(v);
-    addr++;bytes--;
+    case 2:   // digital 16-23
+      return PINC;
+    default:  // digital 24-31
+      return PINA;
   }
-  
-  return checksum;
 }
 
-int doPlaySeq(){
-  seqPos = 0; int i;
-  while(sequence[seqPos].pose != 0xff){
-    int p = sequence[seqPos].pose;
-    // are we HALT?
-    if(Serial.read() == 'H') return 1;
-    // load pose
-    for(i=0; i<controllers[0].poseSize; i++)
-      controllers[0].setNextPose(i+1,poses[p][i]); 
-    controllers[0].interpolateSetup(sequence[seqPos].time);
-    while(controllers[0].interpolating)
-      controllers[0].interpolateStep();
-    // next transition
-    seqPos++;
+/*
+ * Telemetry, pushed to the host every tlm_period ms once subscribed
+ */
+unsigned char tlm_types[TLM_MAX_ITEMS];
+unsigned char tlm_args[TLM_MAX_ITEMS];
+unsigned char tlm_count = 0;
+unsigned int tlm_period = 0;    // ms between frames, 0 = off
+unsigned char tlm_seq = 0;      // sequence number of the next frame
+
+/* bytes an item adds to a telemetry frame */
+int tlmSize(unsigned char type){
+  switch(type){
+    case TLM_SERVO:
+    case TLM_POSE:
+      return 2;
+#ifdef USE_BASE
+    case TLM_ENCODERS:
+      return 8;
+#endif
+    case TLM_REGISTER:
+    case TLM_CONTROLLER:
+      return 1;
+  }
+  return -1;
+}
+
+/* set up telemetry from an ARB_SUBSCRIBE packet, returns an error code */
+unsigned char subscribe(){
+  int n = (length-4)/2;
+  int bytes = 0;
+  if((n > TLM_MAX_ITEMS) || (length < 4)) return ERR_RANGE;
+  for(int i=0; i<n; i++){
+    int size = tlmSize(params[2+(2*i)]);
+    if(size < 0) return ERR_RANGE;
+    bytes += size;
+  }
+  if(bytes > TLM_MAX_BYTES) return ERR_RANGE;
+  for(int i=0; i<n; i++){
+    tlm_types[i] = params[2+(2*i)];
+    tlm_args[i] = params[3+(2*i)];
+  }
+  tlm_count = n;
+  tlm_period = params[0] + (params[1]<<8);
+  tasks.setPeriod(tlm_task, tlm_period);
+  return ERR_NONE;
+}
+
+/* write one byte of a telemetry frame, returns it for the checksum */
+int tlmWrite(unsigned char v){
+  Serial.write(v);
+  return v;
+}
+
+/* send a frame of every subscribed value: ff ff 253 len TLM_ERROR seq time_l time_h values checksum */
+void sendTelemetry(){
+  int len = 5;
+  int i;
+  for(i=0; i<tlm_count; i++)
+    len += tlmSize(tlm_types[i]);
+  unsigned int t = millis();
+  Serial.write(0xff);
+  Serial.write(0xff);
+  int checksum = tlmWrite(253);
+  checksum += tlmWrite(len);
+  checksum += tlmWrite(TLM_ERROR);
+  checksum += tlmWrite(tlm_seq++);
+  checksum += tlmWrite(t&0xff);
+  checksum += tlmWrite(t>>8);
+  for(i=0; i<tlm_count; i++){
+    unsigned char arg = tlm_args[i];
+    int v = 0;
+    switch(tlm_types[i]){
+      case TLM_REGISTER:
+        checksum += tlmWrite(readRegister(arg));
+        break;
+      case TLM_SERVO:
+        v = ax12GetRegister(arg, AX_PRESENT_POSITION_L, 2);   // -1 if no answer
+        checksum += tlmWrite(v&0xff);
+        checksum += tlmWrite((v>>8)&0xff);
+        break;
+      case TLM_POSE:
+        v = -1;
+        for(int c=0; (c<CONTROLLER_COUNT) && (v < 0); c++)
+          v = controllers[c].getCurPose(arg);
+        checksum += tlmWrite(v&0xff);
+        checksum += tlmWrite((v>>8)&0xff);
+        break;
+      case TLM_CONTROLLER:
+        checksum += tlmWrite((arg < CONTROLLER_COUNT) ? controllers[arg].interpolating : 0xff);
+        break;
+#ifdef USE_BASE
+      case TLM_ENCODERS:
+        for(int b=0; b<32; b+=8)
+          checksum += tlmWrite(((unsigned long)Encoders.left>>b)&0xff);
+        for(int b=0; b<32; b+=8)
+          checksum += tlmWrite(((unsigned long)Encoders.right>>b)&0xff);
+        break;
+#endif
+    }
   }
-  return 0;
+  Serial.write(255-(checksum%256));
+}
+
+/*
+ * Sequence playback, stepped from loop() so the host, base and other 
+ *  controllers stay live while a sequence plays on controller 0.
+ */
+void startSeq(unsigned char state){
+  seqPos = 0;
+  seqState = state;
+  if(!synced[0]){
+    controllers[0].readPose();
+    synced[0] = 1;
+  }
+}
+
+void haltSeq(){
+  if(seqState == SEQ_IDLE) return;
+  seqState = SEQ_IDLE;
+  controllers[0].interpolating = 0;     // hold where we are
+}
+
+/* start the next transition once the last one is done */
+void stepSeq(){
+  if((seqState == SEQ_IDLE) || controllers[0].interpolating) return;
+  int p = store.getTransitionPose(seqPos);
+  if(p == STORE_SEQ_END){
+    // an empty sequence can't loop
+    if((seqState == SEQ_PLAY) || (seqPos == 0)){
+      seqState = SEQ_IDLE;
+      return;
+    }
+    seqPos = 0;
+    p = store.getTransitionPose(seqPos);
+  }
+  store.loadPose(&controllers[0], p);
+  controllers[0].interpolateSetup(store.getTransitionTime(seqPos));
+  seqPos++;
 }
 
 /*
@@ -278,271 +482,349 @@ void statusPacket(int id, int err){
   Serial.write(255-((id+2+err)%256));
 }
 
-/* 
- * decode packets: ff ff id length ins params checksum
- *   same as ax-12 table, except, we define new instructions for Arbotix 
+/*
+ * ID = 253, ArbotiX instruction
  */
-void loop(){
+void arbotixPacket(PacketParser & packet){
   int i;
-    
-  // process messages
-  while(Serial.available() > 0){
-    // We need to 0xFF at start of packet
-    if(mode == 0){         // start of new packet
-      if(Serial.read() == 0xff){
-        mode = 2;
-        digitalWrite(0,HIGH-digitalRead(0));
+  switch(ins){     
+    case AX_WRITE_DATA:
+      // send return packet
+      statusPacket(id,handleWrite());
+      break;
+     
+    case AX_READ_DATA:
+      checksum = id + params[1] + 2;                            
+      Serial.write(0xff);
+      Serial.write(0xff);
+      Serial.write(id);
+      Serial.write((unsigned char)2+params[1]);
+      Serial.write((unsigned char)0);
+      // send actual data
+      checksum += handleRead();
+      Serial.write(255-((checksum)%256));
+      break;
+     
+    case ARB_SIZE_POSE:                   // Pose Size = 7, followed by single param: size of pose
+      if(params[0] > controllers[0].capacity()){
+        statusPacket(id,ERR_RANGE);
+        break;
       }
-    //}else if(mode == 1){   // another start byte
-    //    if(Serial.read() == 0xff)
-    //        mode = 2;
-    //    else
-    //        mode = 0;
-    }else if(mode == 2){   // next byte is index of servo
-      id = Serial.read();    
-      if(id != 0xff)
-        mode = 3;
-    }else if(mode == 3){   // next byte is length
-      length = Serial.read();
-      checksum = id + length;
-      mode = 4;
-    }else if(mode == 4){   // next byte is instruction
-      ins = Serial.read();
-      checksum += ins;
-      index = 0;
-      mode = 5;
-    }else if(mode == 5){   // read data in 
-      params[index] = Serial.read();
-      checksum += (int) params[index];
-      index++;
-      if(index + 1 == length){  // we've read params & checksum
-        mode = 0;
-        if((checksum%256) != 255){ 
-          // return an error packet: FF FF id Len Err=bad checksum, params=None check
-          statusPacket(id, ERR_CHECKSUM);
-        }else if(id == 253){  // ID = 253, ArbotiX instruction
-          switch(ins){     
-            case AX_WRITE_DATA:
-              // send return packet
-              statusPacket(id,handleWrite());
-              break;
-             
-            case AX_READ_DATA:
-              checksum = id + params[1] + 2;                            
-              Serial.write(0xff);
-              Serial.write(0xff);
-              Serial.write(id);
-              Serial.write((unsigned char)2+params[1]);
-              Serial.write((unsigned char)0);
-              // send actual data
-              checksum += handleRead();
-              Serial.write(255-((checksum)%256));
-              break;
-             
-            case ARB_SIZE_POSE:                   // Pose Size = 7, followed by single param: size of pose
-              statusPacket(id,0);
-              if(controllers[0].poseSize == 0)
-                controllers[0].setup(18);
-              controllers[0].poseSize = params[0];
-              controllers[0].readPose();    
-              break;
-             
-            case ARB_LOAD_POSE:                   // Load Pose = 8, followed by index, then pose positions (# of param = 2*pose_size)
-              statusPacket(id,0);
-              for(i=0; i<controllers[0].poseSize; i++)
-                poses[params[0]][i] = params[(2*i)+1]+(params[(2*i)+2]<<8); 
-              break;
-             
-            case ARB_LOAD_SEQ:                    // Load Seq = 9, followed by index/times (# of parameters = 3*seq_size) 
-              statusPacket(id,0);
-              for(i=0;i<(length-2)/3;i++){
-                sequence[i].pose = params[(i*3)];
-                sequence[i].time = params[(i*3)+1] + (params[(i*3)+2]<<8);
-              }
-              break;
-             
-            case ARB_PLAY_SEQ:                   // Play Seq = A, no params   
-              statusPacket(id,0);
-              doPlaySeq();
-              break;
-             
-            case ARB_LOOP_SEQ:                   // Play Seq until we recieve a 'H'alt
-              statusPacket(id,0);
-              while(doPlaySeq() > 0);
-              break;
-
-            // ARB_TEST is deprecated and removed
-
-            case ARB_CONTROL_SETUP:              // Setup a controller
-              statusPacket(id,0);
-              if(params[0] < CONTROLLER_COUNT){
-                controllers[params[0]].setup(length-3);
-                for(int i=0; i<length-3; i++){
-                  controllers[params[0]].setId(i, params[i+1]);
-                }
+      statusPacket(id,0);
+      haltSeq();
+      controllers[0].poseSize = params[0];
+      controllers[0].readPose();    
+      synced[0] = 1;
+      store.begin(params[0]);
+      break;
+     
+    case ARB_LOAD_POSE:                   // Load Pose = 8, followed by index, then pose positions (# of param = 2*pose_size)
+      statusPacket(id,0);
+      for(i=0; i<controllers[0].poseSize; i++)
+        store.setPosition(params[0], i, params[(2*i)+1]+(params[(2*i)+2]<<8)); 
+      break;
+     
+    case ARB_LOAD_SEQ:                    // Load Seq = 9, followed by index/times (# of parameters = 3*seq_size) 
+      statusPacket(id,0);
+      for(i=0;i<(length-2)/3;i++)
+        store.setTransition(i, params[(i*3)], params[(i*3)+1] + (params[(i*3)+2]<<8));
+      break;
+     
+    case ARB_PLAY_SEQ:                   // Play Seq = A, no params   
+      statusPacket(id,0);
+      startSeq(SEQ_PLAY);
+      break;
+     
+    case ARB_LOOP_SEQ:                   // Play Seq until we recieve ARB_HALT_SEQ
+      statusPacket(id,0);
+      startSeq(SEQ_LOOP);
+      break;
+
+    case ARB_HALT_SEQ:                   // Stop the sequence, controller 0 holds its pose
+      statusPacket(id,0);
+      haltSeq();
+      break;
+
+    case ARB_SEQ_STATUS:                 // Read state and step of the sequence
+      Serial.write((unsigned char)0xff);
+      Serial.write((unsigned char)0xff);
+      Serial.write((unsigned char)id);
+      Serial.write((unsigned char)4);
+      Serial.write((unsigned char)0);
+      Serial.write((unsigned char)seqState);
+      Serial.write((unsigned char)seqPos);
+      checksum = id + 4 + seqState + seqPos;
+      Serial.write((unsigned char)255-((checksum)%256));
+      break;
+
+    case ARB_STORE_COMMIT:               // Keep poses and sequence across a reset, param: flags
+      statusPacket(id,0);
+      store.commit(params[0]);
+      break;
+
+    case ARB_STORE_LOAD:                 // Reload poses and sequence as at power up
+      haltSeq();
+      if(loadStore())
+        statusPacket(id,0);
+      else
+        statusPacket(id,ERR_RANGE);     // nothing committed
+      break;
+
+    // ARB_TEST is deprecated and removed
+
+    case ARB_CONTROL_SETUP:              // Setup a controller
+      if((params[0] < CONTROLLER_COUNT) && (length-3 > controllers[params[0]].capacity()))
+        statusPacket(id,ERR_RANGE);     // servos past CONTROLLER_SERVOS are dropped
+      else
+        statusPacket(id,0);
+      if(params[0] == 0) haltSeq();
+      if(params[0] < CONTROLLER_COUNT){
+        int n = controllers[params[0]].setup(length-3);
+        for(int i=0; i<n; i++){
+          controllers[params[0]].setId(i, params[i+1]);
+        }
+        synced[params[0]] = 0;
 #ifdef USE_BASE
-              }else if(params[0] == 10){
-                Kp = params[1];
-                Kd = params[2];
-                Ki = params[3];
-                Ko = params[4];
+      }else if(params[0] == 10){
+        Kp = params[1];
+        Kd = params[2];
+        Ki = params[3];
+        Ko = params[4];
 #endif
-              }
-              break;
-
-            case ARB_CONTROL_WRITE:              // Write values to a controller
-              statusPacket(id,0);
-              if(params[0] < CONTROLLER_COUNT){
-                for(int i=0; i<length-4; i+=2){
-                  controllers[params[0]].setNextPose(controllers[params[0]].getId(i/2), params[i+1]+(params[i+2]<<8));
-                }
-                controllers[params[0]].readPose();
-                controllers[params[0]].interpolateSetup(params[length-3]*33);
+      }
+      break;
+
+    case ARB_CONTROL_WRITE:              // Write values to a controller
+      statusPacket(id,0);
+      if(params[0] == 0) haltSeq();
+      if(params[0] < CONTROLLER_COUNT){
+        for(int i=0; i<length-4; i+=2){
+          controllers[params[0]].setNextPose(controllers[params[0]].getId(i/2), params[i+1]+(params[i+2]<<8));
+        }
+        // continue from where we are interpolating, only read the servos the first time
+        if(!synced[params[0]]){
+          controllers[params[0]].readPose();
+          synced[params[0]] = 1;
+        }
+        controllers[params[0]].interpolateSetup(params[length-3]*33);
 #ifdef USE_BASE
-              }else if(params[0] == 10){
-                left_speed = params[1];
-                left_speed += (params[2]<<8);
-                right_speed = params[3];
-                right_speed += (params[4]<<8); 
-                if((left_speed == 0) && (right_speed == 0)){
-                  drive.set(0,0);
-                  ClearPID();
-                }else{
-                  if((left.Velocity == 0) && (right.Velocity == 0)){
-                    PIDmode = 1; moving = 1;
-                    left.PrevEnc = Encoders.left;
-                    right.PrevEnc = Encoders.right;
-                  }
-                }   
-                left.Velocity = left_speed;
-                right.Velocity = right_speed; 
+      }else if(params[0] == 10){
+        left_speed = params[1];
+        left_speed += (params[2]<<8);
+        right_speed = params[3];
+        right_speed += (params[4]<<8); 
+        if((left_speed == 0) && (right_speed == 0)){
+          drive.set(0,0);
+          ClearPID();
+        }else{
+          if((left.Velocity == 0) && (right.Velocity == 0)){
+            PIDmode = 1; moving = 1;
+            left.PrevEnc = Encoders.left;
+            right.PrevEnc = Encoders.right;
+          }
+        }   
+        left.Velocity = left_speed;
+        right.Velocity = right_speed; 
 #endif
-              }
-              break;
-
-            case ARB_CONTROL_STAT:               // Read status of a controller
-              if(params[0] < CONTROLLER_COUNT){             
-                Serial.write((unsigned char)0xff);
-                Serial.write((unsigned char)0xff);
-                Serial.write((unsigned char)id);
-                Serial.write((unsigned char)3);
-                Serial.write((unsigned char)0);
-                checksum = controllers[params[0]].interpolating;
-                Serial.write((unsigned char)checksum);
-                checksum += id + 3;
-                Serial.write((unsigned char)255-((checksum)%256));
-#ifdef USE_BASE
-              }else if(params[0] == 10){
-                checksum = id + 2 + 8;                            
-                Serial.write((unsigned char)0xff);
-                Serial.write((unsigned char)0xff);
-                Serial.write((unsigned char)id);
-                Serial.write((unsigned char)2+8);
-                Serial.write((unsigned char)0);   // error level
-                int v = ((unsigned long)Encoders.left>>0)%256;
-                Serial.write((unsigned char)v);
-                checksum += v;
-                v = ((unsigned long)Encoders.left>>8)%256;
-                Serial.write((unsigned char)v);
-                checksum += v;
-                v = ((unsigned long)Encoders.left>>16)%256;
-                Serial.write((unsigned char)v);
-                checksum += v;
-                v = ((unsigned long)Encoders.left>>24)%256;
-                Serial.write((unsigned char)v);
-                checksum += v;
-                v = ((unsigned long)Encoders.right>>0)%256;
-                Serial.write((unsigned char)v);
-                checksum += v;
-                v = ((unsigned long)Encoders.right>>8)%256;
-                Serial.write((unsigned char)v);
-                checksum += v;
-                v = ((unsigned long)Encoders.right>>16)%256;
-                Serial.write((unsigned char)v);
-                checksum += v;
-                v = ((unsigned long)Encoders.right>>24)%256;
-                Serial.write((unsigned char)v);
-                checksum += v;
-                Serial.write((unsigned char)255-((checksum)%256));
+      }
+      break;
+
+#ifdef USE_QUEUE
+    case ARB_CONTROL_QUEUE:              // Queue a setpoint on a controller
+      if((params[0] < CONTROLLER_COUNT) && ((length-5)/2 == controllers[params[0]].poseSize) &&
+         (controllers[params[0]].poseSize <= QUEUE_SERVOS)){
+        int pose[QUEUE_SERVOS];
+        int n = (length-5)/2;
+        for(i=0; i<n; i++)
+          pose[i] = params[(2*i)+1]+(params[(2*i)+2]<<8);
+        if(controllers[params[0]].queueSetpoint(pose, params[length-4]+(params[length-3]<<8)) > 0)
+          statusPacket(id,0);
+        else
+          statusPacket(id,ERR_OVERLOAD);  // queue full, setpoint dropped
+      }else{
+        statusPacket(id,ERR_RANGE);
+      }
+      break;
 #endif
-              }
-              break;
-          }
-        }else if(id == 0xFE){
-          // sync read or write
-          if(ins == ARB_SYNC_READ){
-            int start = params[0];    // address to read in control table
-            int bytes = params[1];    // # of bytes to read from each servo
-            int k = 2;
-            checksum = id + (bytes*(length-4)) + 2;                            
-            Serial.write((unsigned char)0xff);
-            Serial.write((unsigned char)0xff);
-            Serial.write((unsigned char)id);
-            Serial.write((unsigned char)2+(bytes*(length-4)));
-            Serial.write((unsigned char)0);     // error code
-            // send actual data
-            for(k=2; k<length-2; k++){
-              if( ax12GetRegister(params[k], start, bytes) >= 0){
-                for(i=0;i<bytes;i++){
-                  checksum += ax_rx_buffer[5+i];
-                  Serial.write((unsigned char)ax_rx_buffer[5+i]);
-                }
-              }else{
-                for(i=0;i<bytes;i++){
-                  checksum += 255;
-                  Serial.write((unsigned char)255);
-                }
-              }
-            }
-            Serial.write((unsigned char)255-((checksum)%256));
-          }else{    
-            // TODO: sync write pass thru
-            int k;
-            setTXall();
-            ax12write(0xff);
-            ax12write(0xff);
-            ax12write(id);
-            ax12write(length);
-            ax12write(ins);
-            for(k=0; k<length; k++)
-                ax12write(params[k]);
-            // no return
-          }       
-        }else{ // ID != 253, pass thru 
-          switch(ins){
-            // TODO: streamline this
-            case AX_READ_DATA:
-              ax12GetRegister(id, params[0], params[1]);
-              // return a packet: FF FF id Len Err params check
-              if(ax_rx_buffer[3] > 0){
-                for(i=0;i<ax_rx_buffer[3]+4;i++)
-                  Serial.write(ax_rx_buffer[i]);
-              }
-              ax_rx_buffer[3] = 0;
-              break;
-             
-            case AX_WRITE_DATA:
-              if(length == 4){
-                ax12SetRegister(id, params[0], params[1]);
-              }else{
-                int x = params[1] + (params[2]<<8);
-                ax12SetRegister2(id, params[0], x);
-              }
-              statusPacket(id,0);
-              break;
-             
-          }
-        }
+
+    case ARB_CONTROL_RESYNC:             // Read the pose of a controller back from its servos
+      if(params[0] < CONTROLLER_COUNT){
+        if(controllers[params[0]].readPose() > 0)
+          statusPacket(id,ERR_RANGE);     // some servos did not answer
+        else
+          statusPacket(id,0);
+        controllers[params[0]].interpolating = 0;
+        synced[params[0]] = 1;
+      }else{
+        statusPacket(id,ERR_RANGE);
       }
-    } // end mode == 5
-  } // end while(available)
-  // update joints
-  for(int i=0; i<5; i++)
-    controllers[i].interpolateStep();
- 
+      break;
+
+    case ARB_SUBSCRIBE:                  // Push values to the host at a fixed rate
+      statusPacket(id,subscribe());
+      break;
+
+    case ARB_CONTROL_STAT:               // Read status of a controller
+      if(params[0] < CONTROLLER_COUNT){             
+        Serial.write((unsigned char)0xff);
+        Serial.write((unsigned char)0xff);
+        Serial.write((unsigned char)id);
+        Serial.write((unsigned char)3);
+        Serial.write((unsigned char)0);
+        checksum = controllers[params[0]].interpolating;
+        Serial.write((unsigned char)checksum);
+        checksum += id + 3;
+        Serial.write((unsigned char)255-((checksum)%256));
 #ifdef USE_BASE
-  // update pid
-  updatePID();
+      }else if(params[0] == 10){
+        checksum = id + 2 + 8;                            
+        Serial.write((unsigned char)0xff);
+        Serial.write((unsigned char)0xff);
+        Serial.write((unsigned char)id);
+        Serial.write((unsigned char)2+8);
+        Serial.write((unsigned char)0);   // error level
+        int v = ((unsigned long)Encoders.left>>0)%256;
+        Serial.write((unsigned char)v);
+        checksum += v;
+        v = ((unsigned long)Encoders.left>>8)%256;
+        Serial.write((unsigned char)v);
+        checksum += v;
+        v = ((unsigned long)Encoders.left>>16)%256;
+        Serial.write((unsigned char)v);
+        checksum += v;
+        v = ((unsigned long)Encoders.left>>24)%256;
+        Serial.write((unsigned char)v);
+        checksum += v;
+        v = ((unsigned long)Encoders.right>>0)%256;
+        Serial.write((unsigned char)v);
+        checksum += v;
+        v = ((unsigned long)Encoders.right>>8)%256;
+        Serial.write((unsigned char)v);
+        checksum += v;
+        v = ((unsigned long)Encoders.right>>16)%256;
+        Serial.write((unsigned char)v);
+        checksum += v;
+        v = ((unsigned long)Encoders.right>>24)%256;
+        Serial.write((unsigned char)v);
+        checksum += v;
+        Serial.write((unsigned char)255-((checksum)%256));
 #endif
+      }
+      break;
+  }
+}
+
+/*
+ * ID = 0xFE, sync read or write
+ */
+void syncPacket(PacketParser & packet){
+  int i;
+  // sync read or write
+  if(ins == ARB_SYNC_READ){
+    int start = params[0];    // address to read in control table
+    int bytes = params[1];    // # of bytes to read from each servo
+    int k = 2;
+    checksum = id + (bytes*(length-4)) + 2;                            
+    Serial.write((unsigned char)0xff);
+    Serial.write((unsigned char)0xff);
+    Serial.write((unsigned char)id);
+    Serial.write((unsigned char)2+(bytes*(length-4)));
+    Serial.write((unsigned char)0);     // error code
+    // send actual data
+    for(k=2; k<length-2; k++){
+      if( ax12GetRegister(params[k], start, bytes) >= 0){
+        for(i=0;i<bytes;i++){
+          checksum += ax_rx_buffer[5+i];
+          Serial.write((unsigned char)ax_rx_buffer[5+i]);
+        }
+      }else{
+        for(i=0;i<bytes;i++){
+          checksum += 255;
+          Serial.write((unsigned char)255);
+        }
+      }
+    }
+    Serial.write((unsigned char)255-((checksum)%256));
+  }else{
+    // sync write, or any other broadcast: no servo will answer
+    forward(packet);
+  }
+}
 
+/*
+ * ID != 253, pass thru: stream a packet from the host to the bus as is, and relay any reply.
+ *  the frame is already validated by the parser, checksum included.
+ */
+void forward(PacketParser & packet){
+  unsigned char * frame = packet.frame();
+  int i;
+  // READ_DATA returns the registers asked for, everything else a bare status
+  int reply = (ins == AX_READ_DATA) ? params[1]+6 : 6;
+  if(reply > AX12_BUFFER_SIZE){
+    // the reply would overrun ax_rx_buffer
+    statusPacket(id,ERR_RANGE);
+    return;
+  }
+  if(id == 0xFE)
+    setTXall();
+  else
+    setTX(id);
+  for(i=0; i<length+4; i++)
+    ax12write(frame[i]);
+  if(id == 0xFE){
+    setRX(0);
+    return;
+  }
+  setRX(id);
+  if(ax12ReadPacket(reply) > 0){
+    for(i=0; i<reply; i++)
+      Serial.write(ax_rx_buffer[i]);
+  }else if((ins != AX_READ_DATA) && (ins != AX_PING)){
+    // servo is set to only answer reads, keep the host in step
+    statusPacket(id,0);
+  }
+}
+
+const packet_route_t routes[] = {
+  {253, arbotixPacket},
+  {0xFE, syncPacket},
+  {PACKET_ANY_ID, forward}
+};
+
+/* 
+ * decode packets: ff ff id length ins params checksum
+ *   same as ax-12 table, except, we define new instructions for Arbotix 
+ */
+void readHost(){
+  int status;
+  while((status = parser.update()) != PACKET_NONE){
+    id = parser.id();
+    length = parser.length();
+    ins = parser.ins();
+    params = parser.params();
+    digitalWrite(0,HIGH-digitalRead(0));
+    if(status == PACKET_BAD_CHECKSUM){
+      // return an error packet: FF FF id Len Err=bad checksum, params=None check
+      statusPacket(id, ERR_CHECKSUM);
+    }else{
+      parser.dispatch(routes, 3);
+    }
+    parser.next();
+  }
+}
+
+/* once a frame, the group no longer waits for it */
+void updateJoints(){
+  stepSeq();
+  group.update();
+}
+
+/* runs every tlm_period ms, the scheduler skips ahead rather than burst when behind */
+void pushTelemetry(){
+  if(tlm_period > 0)
+    sendTelemetry();
+}
+
+void loop(){
+  tasks.update();
 }
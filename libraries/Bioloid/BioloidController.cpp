@@ -19,47 +19,149 @@
 
 #include "BioloidController.h"
 
+/* traits of each servo model, indexed by BIOLOID_MODEL_* */
+static const bioloid_model_t bioloid_models[] PROGMEM = {
+    {1023, 512, BIOLOID_SPEED_SCALE},       // AX-12/18, 300 degrees in 1024 counts
+    {4095, 2048, 129}                       // MX-28/64/106, 360 degrees in 4096 counts
+};
+
 /* initializes serial1 transmit at baud, 8-N-1 */
 BioloidController::BioloidController(long baud){
-    int i;
-    // setup storage
-    id_ = (unsigned char *) malloc(AX12_MAX_SERVOS * sizeof(unsigned char));
-    pose_ = (unsigned int *) malloc(AX12_MAX_SERVOS * sizeof(unsigned int));
-    nextpose_ = (unsigned int *) malloc(AX12_MAX_SERVOS * sizeof(unsigned int));
-    speed_ = (int *) malloc(AX12_MAX_SERVOS * sizeof(int));
-    // initialize
-    for(i=0;i<AX12_MAX_SERVOS;i++){
-        id_[i] = i+1;
-        pose_[i] = 512;
-        nextpose_[i] = 512;
-    }
+    // setup storage, legacy controllers can hold any servo on the bus
+    reset_();
+    allocate_(AX12_MAX_SERVOS);
+    // initialize, capacity_ stays 0 if the heap is exhausted
+    init_(capacity_);
+    poseSize = 0;
+    ax12Init(baud);  
+}
+
+/* new-style constructor, storage is provided later by setup() */
+BioloidController::BioloidController(){
+    reset_();
+}
+
+/* state shared by both constructors, before any storage is attached */
+void BioloidController::reset_(){
+    storage_ = NULL;
+    capacity_ = 0;
+    owned_ = 0;
+    feedback_ = NULL;
+    layers_ = NULL;
+    layerCount_ = 0;
+    limits_ = NULL;
+    limiting_ = 0;
+    spare_ = NULL;
+    fade_ = NULL;
+    fadeTime_ = 0;
+    queuePoses_ = NULL;
+    packed_ = 0;
+    far_ = 0;
+    prefetched_ = 0;
+    playRate_ = BIOLOID_RATE_ONE;
+    loopCount_ = 0;
+    loops_ = 0;
+    pingpong_ = 0;
+    output_ = NULL;
+    budget_ = 0;
+    fadeStart_ = 0;
+    fadeWeight_ = 0;
+    queueTimes_ = NULL;
+    queueDepth_ = 0;
+    queueStride_ = 0;
+    queueHead_ = 0;
+    queueEnd_ = 0;
+    seqLength_ = 0;
+    seqIndex_ = 0;
+    direction_ = 1;
+    packedStart_ = 0;
+    packedIndex_ = 0;
+    fetchsize_ = 0;
+    fetchtime_ = 0;
+    poseSize = 0;
     interpolating = 0;
     playing = 0;
-    lastframe_ = millis();
-    ax12Init(baud);  
+    mode_ = BIOLOID_MODE_FRAMES;
+    speedset_ = 0;
 }
 
-/* new-style setup */
-void BioloidController::setup(int servo_cnt){
+/* new-style setup, may be called again to reconfigure the controller. 
+    Storage is only allocated when servo_cnt exceeds what we already have. */
+int BioloidController::setup(int servo_cnt){
+    if(servo_cnt > capacity_){
+        if((storage_ != NULL) && (owned_ == 0)){
+            // fixed storage, can't grow
+            servo_cnt = capacity_;
+        }else{
+            void * old = storage_;
+            if(allocate_(servo_cnt))
+                free(old);
+            else
+                servo_cnt = capacity_;  // out of memory, keep what we have
+        }
+    }
+    init_(servo_cnt);
+    return servo_cnt;
+}
+/* setup using caller-supplied storage of at least BIOLOID_STORAGE(servo_cnt) bytes */
+int BioloidController::setup(int servo_cnt, void * storage){
+    if(owned_ > 0) free(storage_);
+    attach_(storage, servo_cnt);
+    owned_ = 0;
+    init_(servo_cnt);
+    return servo_cnt;
+}
+
+/* carve a block of storage into our per-servo arrays */
+void BioloidController::attach_(void * storage, int servo_cnt){
+    unsigned int * p = (unsigned int *) storage;
+    storage_ = storage;
+    pose_ = p; p += servo_cnt;
+    nextpose_ = p; p += servo_cnt;
+    lastpose_ = p; p += servo_cnt;
+    fetchpose_ = p; p += servo_cnt;
+    speed_ = (int *) p; p += servo_cnt;
+    fetchspeed_ = (int *) p; p += servo_cnt;
+    id_ = (unsigned char *) p;
+    flags_ = id_ + servo_cnt;
+    rate_ = flags_ + servo_cnt;
+    tick_ = rate_ + servo_cnt;
+    capacity_ = servo_cnt;
+}
+int BioloidController::allocate_(int servo_cnt){
+    void * storage = malloc(BIOLOID_STORAGE(servo_cnt));
+    if(storage == NULL) return 0;
+    attach_(storage, servo_cnt);
+    owned_ = 1;
+    return 1;
+}
+/* reset the first servo_cnt servos to defaults */
+void BioloidController::init_(int servo_cnt){
     int i;
-    // setup storage
-    id_ = (unsigned char *) malloc(servo_cnt * sizeof(unsigned char));
-    pose_ = (unsigned int *) malloc(servo_cnt * sizeof(unsigned int));
-    nextpose_ = (unsigned int *) malloc(servo_cnt * sizeof(unsigned int));
-    speed_ = (int *) malloc(servo_cnt * sizeof(int));
-    // initialize
     poseSize = servo_cnt;
     for(i=0;i<poseSize;i++){
         id_[i] = i+1;
-        pose_[i] = 512;
-        nextpose_[i] = 512;
+        flags_[i] = 0;
+        pose_[i] = center_(i);
+        nextpose_[i] = center_(i);
+        lastpose_[i] = BIOLOID_UNKNOWN;
+        rate_[i] = 1;
+        tick_[i] = 1;
     }
     interpolating = 0;
     playing = 0;
+    mode_ = BIOLOID_MODE_FRAMES;
+    speedset_ = 0;
+    readIndex_ = 0;
+    queueCount_ = 0;
+    streaming_ = 0;
+    frameLength_ = BIOLOID_FRAME_LENGTH;
     lastframe_ = millis();
 }
+
 void BioloidController::setId(int index, int id){
     id_[index] = id;
+    lastpose_[index] = BIOLOID_UNKNOWN;
 }
 int BioloidController::getId(int index){
     return id_[index];
@@ -67,22 +169,110 @@ int BioloidController::getId(int index){
 
 /* load a named pose from FLASH into nextpose. */
 void BioloidController::loadPose( const unsigned int * addr ){
+    poseSize = loadRaw_(addr, nextpose_);
+}
+/* copy a pose from FLASH into DEST, returns the number of servos in it */
+int BioloidController::loadRaw_( const unsigned int * addr, unsigned int * dest ){
+    int i;
+    int count = pgm_read_word_near(addr); // number of servos in this pose
+    for(i=0; i<count; i++)
+        dest[i] = pgm_read_word_near(addr+1+i) << BIOLOID_SHIFT;
+    return count;
+}
+/* load pose INDEX of a packed pose set from FLASH into nextpose. The set is 
+    decoded from the start, as each pose is stored relative to the one before. */
+void BioloidController::loadPose( const unsigned char * addr, int index ){
+    far_ = 0;
+    loadPacked_((unsigned long) addr, index);
+}
+void BioloidController::loadPacked_( unsigned long addr, int index ){
     int i;
-    poseSize = pgm_read_word_near(addr); // number of servos in this pose
+    if(index >= readByte_(addr+1)) return;
+    poseSize = readByte_(addr);
+    addr = unpackPose_(addr+2, 1, nextpose_);
+    for(i=0; i<index; i++)
+        addr = unpackPose_(addr, 0, nextpose_);
+}
+/* read a byte of FLASH, from above 64K if far_ is set */
+unsigned char BioloidController::readByte_( unsigned long addr ){
+#ifdef BIOLOID_FAR
+    if(far_ > 0)
+        return pgm_read_byte_far(addr);
+#endif
+    return pgm_read_byte_near((unsigned int) addr);
+}
+/* decode a packed pose record into DEST, returns the address just after it. 
+    ABSOLUTE records are 16-bit positions, others are 8-bit signed deltas from 
+    what is already in DEST, where BIOLOID_PACK_ESCAPE is followed by a 16-bit position. */
+unsigned long BioloidController::unpackPose_( unsigned long addr, unsigned char absolute, unsigned int * dest ){
+    int i;
+    unsigned int pos;
+    for(i=0; i<poseSize; i++){
+        signed char delta = BIOLOID_PACK_ESCAPE;
+        if(absolute == 0)
+            delta = (signed char) readByte_(addr++);
+        if(delta == BIOLOID_PACK_ESCAPE){
+            pos = readByte_(addr) + (readByte_(addr+1)<<8);
+            addr += 2;
+        }else{
+            pos = (dest[i] >> BIOLOID_SHIFT) + delta;
+        }
+        dest[i] = pos << BIOLOID_SHIFT;
+    }
+    return addr;
+}
+
+#ifdef BIOLOID_FAR
+/* load a pose from anywhere in FLASH, addr from pgm_get_far_address() */
+void BioloidController::loadPoseFar( uint_farptr_t addr ){
+    int i;
+    poseSize = pgm_read_word_far(addr); // number of servos in this pose
     for(i=0; i<poseSize; i++)
-        nextpose_[i] = pgm_read_word_near(addr+1+i) << BIOLOID_SHIFT;
+        nextpose_[i] = pgm_read_word_far(addr+2+(2*i)) << BIOLOID_SHIFT;
+}
+/* load pose INDEX of a packed pose set from anywhere in FLASH */
+void BioloidController::loadPoseFar( uint_farptr_t addr, int index ){
+    far_ = 1;
+    loadPacked_(addr, index);
 }
-/* read in current servo positions to the pose. */
-void BioloidController::readPose(){
+/* play a packed sequence from anywhere in FLASH */
+void BioloidController::playSeqFar( uint_farptr_t addr ){
+    beginFade_();
+    far_ = 1;
+    playPacked_(addr);
+}
+#endif
+
+/* read in current servo positions to the pose, back to back. Servos that do not
+    answer keep their old position and are flagged, see readFailed(). 
+    Returns the number of servos that failed. */
+int BioloidController::readPose(){
+    int failed = 0;
     for(int i=0;i<poseSize;i++){
-        pose_[i] = ax12GetRegister(id_[i],AX_PRESENT_POSITION_L,2)<<BIOLOID_SHIFT;
-        delay(25);   
+        int pos = ax12GetRegister(id_[i],AX_PRESENT_POSITION_L,2);
+        if(pos < 0){
+            flags_[i] |= BIOLOID_READ_FAILED;
+            failed++;
+        }else{
+            flags_[i] &= ~BIOLOID_READ_FAILED;
+            pose_[i] = pos<<BIOLOID_SHIFT;
+        }
     }
+    invalidatePose();
+    return failed;
+}
+/* did this storage index fail to answer the last readPose()? */
+int BioloidController::readFailed(int index){
+    return (flags_[index] & BIOLOID_READ_FAILED) ? 1 : 0;
 }
-/* write pose out to servos using sync write. */
+/* write pose out to servos using sync write, servos which have not 
+    changed since the last frame are left out of the packet. */
 void BioloidController::writePose(){
-    int temp;
-    int length = 4 + (poseSize * 3);   // 3 = id + pos(2byte)
+    writeSync_(changed_());
+}
+void BioloidController::writeSync_(int count){
+    if(count == 0) return;      // nothing moved, leave the bus alone
+    int length = 4 + (count * 3);   // 3 = id + pos(2byte)
     int checksum = 254 + length + AX_SYNC_WRITE + 2 + AX_GOAL_POSITION_L;
     setTXall();
     ax12write(0xFF);
@@ -92,47 +282,500 @@ void BioloidController::writePose(){
     ax12write(AX_SYNC_WRITE);
     ax12write(AX_GOAL_POSITION_L);
     ax12write(2);
+    checksum += writeChanged_();
+    ax12write(0xff - (checksum % 256));
+    setRX(0);
+}
+/* how many servos differ from what was last sent. With layers or limits, this 
+    is where the frame is composited. */
+int BioloidController::changed_(){
+    int count = 0;
+    limiting_ = 0;
+    for(int i=0; i<poseSize; i++){
+        if((layerCount_ > 0) || (limits_ != NULL)){
+            unsigned int pos = (layerCount_ > 0) ? composite_(i, base_(i)) : base_(i);
+            if(limits_ != NULL)
+                pos = limit_(i, pos);
+            if(layerCount_ > 0)
+                output_[i] = pos >> BIOLOID_SHIFT;
+        }
+        if(out_(i) != lastpose_[i])
+            count++;
+    }
+    return count;
+}
+/* position to send servo I this frame */
+int BioloidController::unsent_(){
+    int count = 0;
+    for(int i=0; i<poseSize; i++){
+        if(out_(i) != lastpose_[i])
+            count++;
+    }
+    return count;
+}
+unsigned int BioloidController::out_(int i){
+    if(layerCount_ > 0)
+        return output_[i];
+    if(limits_ != NULL)
+        return limits_[i].position >> BIOLOID_SHIFT;
+    return base_(i) >> BIOLOID_SHIFT;
+}
+/* goal position of servo I, in goal speed mode */
+unsigned int BioloidController::goal_(int i){
+    unsigned int pos = (layerCount_ > 0) ? composite_(i, nextpose_[i]) : nextpose_[i];
+    pos = pos >> BIOLOID_SHIFT;
+    // servos limit their own speed here, only keep them in range
+    if(limits_ != NULL){
+        if(pos < limits_[i].min){
+            pos = limits_[i].min;
+            limits_[i].saturated++;
+        }else if(pos > limits_[i].max){
+            pos = limits_[i].max;
+            limits_[i].saturated++;
+        }
+    }
+    return pos;
+}
+/* hold POS (shifted) of servo I within its limits, counting when it is clipped. 
+    Velocity and acceleration are limited per frame, starting from the last 
+    output, so the output may lag the pose until it catches up. */
+unsigned int BioloidController::limit_(int i, unsigned int pos){
+    bioloid_limits_t * l = &limits_[i];
+    unsigned char clipped = 0;
+    long p = pos;
+    if(p < ((long) l->min << BIOLOID_SHIFT)){
+        p = (long) l->min << BIOLOID_SHIFT;
+        clipped = 1;
+    }else if(p > ((long) l->max << BIOLOID_SHIFT)){
+        p = (long) l->max << BIOLOID_SHIFT;
+        clipped = 1;
+    }
+    if(l->position == BIOLOID_UNKNOWN){
+        // nothing to limit against until the servo has a known position
+        if(lastpose_[i] == BIOLOID_UNKNOWN){
+            l->position = p;
+            if(clipped) l->saturated++;
+            return p;
+        }
+        l->position = lastpose_[i] << BIOLOID_SHIFT;
+    }
+    long v = p - (long) l->position;   // shifted positions per frame
+    if(l->accel > 0){
+        // positions/s^2 to shifted positions/frame^2
+        long a = ((((long) l->accel << BIOLOID_SHIFT) * frameLength_) / 1000 * frameLength_) / 1000 + 1;
+        if(v > l->speed + a){
+            v = l->speed + a;
+            clipped = 1;
+        }else if(v < l->speed - a){
+            v = l->speed - a;
+            clipped = 1;
+        }
+    }
+    if(l->velocity > 0){
+        // positions/s to shifted positions/frame
+        long m = (((long) l->velocity << BIOLOID_SHIFT) * frameLength_) / 1000 + 1;
+        if(v > m){
+            v = m;
+            clipped = 1;
+        }else if(v < -m){
+            v = -m;
+            clipped = 1;
+        }
+    }
+    if(clipped) l->saturated++;
+    if(l->position + v != p) limiting_ = 1;
+    l->speed = v;
+    l->position += v;
+    return l->position;
+}
+/* add the weighted offsets of each layer to BASE, both shifted, and clamp to the servo's range */
+unsigned int BioloidController::composite_(int i, unsigned int base){
+    long offset = 0;
+    for(int l=0; l<layerCount_; l++){
+        if(layers_[l].offset != NULL)
+            offset += (long) layers_[l].weight * layers_[l].offset[i];
+    }
+    // weights are 8.8, keep our extra bits of resolution until the end
+    long pos = (long) base + (offset >> (8 - BIOLOID_SHIFT));
+    if(pos < 0) pos = 0;
+    long max = (long) pgm_read_word_near(&bioloid_models[model_(i)].max) << BIOLOID_SHIFT;
+    if(pos > max) pos = max;
+    return (unsigned int) pos;
+}
+/* send the id/position of each changed servo, returns the checksum of the bytes sent. */
+int BioloidController::writeChanged_(){
+    unsigned int temp;
+    int checksum = 0;
     for(int i=0; i<poseSize; i++)
     {
-        temp = pose_[i] >> BIOLOID_SHIFT;
+        temp = out_(i);
+        if(temp == lastpose_[i]) continue;
+        lastpose_[i] = temp;
         checksum += (temp&0xff) + (temp>>8) + id_[i];
         ax12write(id_[i]);
         ax12write(temp&0xff);
         ax12write(temp>>8);
     } 
-    ax12write(0xff - (checksum % 256));
-    setRX(0);
+    return checksum;
+}
+/* forget what was last sent, so that the next writePose() sends every servo. */
+void BioloidController::invalidatePose(){
+    for(int i=0; i<poseSize; i++)
+        lastpose_[i] = BIOLOID_UNKNOWN;
 }
 
 /* set up for an interpolation from pose to nextpose over TIME 
     milliseconds by setting servo speeds. */
 void BioloidController::interpolateSetup(int time){
-    int i;
-    int frames = (time/BIOLOID_FRAME_LENGTH) + 1;
     lastframe_ = millis();
-    // set speed each servo...
-    for(i=0;i<poseSize;i++){
-        if(nextpose_[i] > pose_[i]){
-            speed_[i] = (nextpose_[i] - pose_[i])/frames + 1;
+    computeSpeeds_(pose_, nextpose_, speed_, poseSize, time);
+    interpolating = 1;
+    if(mode_ == BIOLOID_MODE_GOAL_SPEED)
+        writeGoals_(time);
+}
+/* set speed of the first COUNT servos to get FROM to TO in TIME milliseconds */
+void BioloidController::computeSpeeds_(const unsigned int * from, const unsigned int * to, int * speed, int count, int time){
+    int i;
+    int frames;
+    for(i=0;i<count;i++){
+        // slower servos get fewer, larger steps
+        frames = (time/(frameLength_*rate_[i])) + 1;
+        if(to[i] > from[i]){
+            speed[i] = (to[i] - from[i])/frames + 1;
         }else{
-            speed_[i] = (pose_[i]-nextpose_[i])/frames + 1;
+            speed[i] = (from[i] - to[i])/frames + 1;
         }
     }
-    interpolating = 1;
 }
 /* interpolate our pose, this should be called at about 30Hz. */
 void BioloidController::interpolateStep(){
-    if(interpolating == 0) return;
+    if((interpolating == 0) && (nextSetpoint_() == 0) && (layerCount_ == 0) && (limiting_ == 0) && 
+       (fade_ == NULL)) return;
+    waitFrame_();
+    lastframe_ = millis();
+    stepPose_();
+    // in goal speed mode the servos interpolate themselves, we only track the pose
+    if(mode_ == BIOLOID_MODE_FRAMES)
+        writePose();      
+}
+
+/* set the model of a servo, BIOLOID_MODEL_AX or BIOLOID_MODEL_MX. Positions of 
+    a servo are always in its own counts, so MX poses run 0-4095. */
+void BioloidController::setModel(int id, unsigned char model){
+    for(int i=0; i<poseSize; i++){
+        if( id_[i] == id ){
+            setModel_(i, model);
+            return;
+        }
+    }
+}
+int BioloidController::getModel(int id){
+    for(int i=0; i<poseSize; i++){
+        if( id_[i] == id )
+            return model_(i);
+    }
+    return -1;
+}
+/* set the model of each servo from its model number register, servos that 
+    do not answer are left as they were. Returns the number that failed. */
+int BioloidController::discoverModels(){
+    int failed = 0;
+    for(int i=0; i<poseSize; i++){
+        int number = ax12GetRegister(id_[i], AX_MODEL_NUMBER_L, 2);
+        if(number < 0){
+            failed++;
+            continue;
+        }
+        unsigned char model = BIOLOID_MODEL_AX;
+        if((number == 29) || (number == 310) || (number == 320) || (number == 360))
+            model = BIOLOID_MODEL_MX;
+        setModel_(i, model);
+    }
+    return failed;
+}
+void BioloidController::setModel_(int i, unsigned char model){
+    unsigned int old = center_(i);
+    flags_[i] = (flags_[i] & ~BIOLOID_MODEL_MASK) | (model << BIOLOID_MODEL_BIT);
+    // a servo that was never given a pose follows its new center
+    if((pose_[i] == old) && (nextpose_[i] == old)){
+        pose_[i] = center_(i);
+        nextpose_[i] = center_(i);
+    }
+}
+unsigned int BioloidController::center_(int i){
+    return pgm_read_word_near(&bioloid_models[model_(i)].center) << BIOLOID_SHIFT;
+}
+/* center position of a servo, for its model */
+int BioloidController::getCenter(int id){
+    for(int i=0; i<poseSize; i++){
+        if( id_[i] == id )
+            return pgm_read_word_near(&bioloid_models[model_(i)].center);
+    }
+    return -1;
+}
+
+/* set the time between frames, in milliseconds */
+void BioloidController::setFrameLength(unsigned char ms){
+    if(ms < 1) ms = 1;
+    frameLength_ = ms;
+}
+/* update a servo only every DIVIDER frames, for instance with a 10ms frame length 
+    a head can run at 100Hz (divider 1) while legs run at 33Hz (divider 3). */
+void BioloidController::setRate(int id, unsigned char divider){
+    if(divider < 1) divider = 1;
+    for(int i=0; i<poseSize; i++){
+        if( id_[i] == id ){
+            rate_[i] = divider;
+            tick_[i] = (i % divider) + 1;   // offset by index to spread the load
+            return;
+        }
+    }
+}
+
+/* wait for the next frame, using the idle bus time to read back positions. */
+void BioloidController::waitFrame_(){
+    unsigned long start = micros();
+    while(millis() - lastframe_ < frameLength_){
+        if((feedback_ != NULL) && (micros() - start < budget_) && 
+           (millis() - lastframe_ + BIOLOID_READ_MARGIN < frameLength_))
+            readNext_();
+    }
+}
+/* read back the present position of the next servo in round-robin order. */
+void BioloidController::readNext_(){
+    if(poseSize == 0) return;
+    if(readIndex_ >= poseSize) readIndex_ = 0;
+    int i = readIndex_++;
+    int pos = ax12GetRegister(id_[i],AX_PRESENT_POSITION_L,2);
+    if(pos < 0){
+        flags_[i] |= BIOLOID_READ_FAILED;
+        return;
+    }
+    flags_[i] &= ~BIOLOID_READ_FAILED;
+    feedback_[i].position = pos;
+    // compare against what the servo has been told to do
+    if((mode_ == BIOLOID_MODE_FRAMES) && (lastpose_[i] != BIOLOID_UNKNOWN))
+        feedback_[i].error = pos - (int) lastpose_[i];
+    else
+        feedback_[i].error = pos - (int) (pose_[i] >> BIOLOID_SHIFT);
+}
+/* add COUNT layers of offsets on top of the interpolated pose. OUTPUT must hold 
+    capacity() positions, it is filled with the composited pose each frame. 
+    Layers are kept by reference, so their offsets and weights can be changed at 
+    any time, the next frame picks them up. Pass NULL to remove the layers. */
+void BioloidController::setLayers(bioloid_layer_t * layers, unsigned char count, unsigned int * output){
+    layers_ = layers;
+    output_ = output;
+    layerCount_ = (layers == NULL) ? 0 : count;
+}
+/* enforce per-servo LIMITS, one per storage index, on everything we send. The 
+    caller fills in min, max, velocity and accel; state is reset here. Pass NULL 
+    to remove the limits. */
+void BioloidController::setLimits(bioloid_limits_t * limits){
+    limits_ = limits;
+    limiting_ = 0;
+    if(limits_ == NULL) return;
+    for(int i=0; i<capacity_; i++){
+        limits_[i].position = BIOLOID_UNKNOWN;
+        limits_[i].speed = 0;
+        limits_[i].saturated = 0;
+    }
+}
+/* times a servo has been clipped by its limits */
+unsigned int BioloidController::getSaturated(int id){
+    if(limits_ == NULL) return 0;
+    for(int i=0; i<poseSize; i++){
+        if( id_[i] == id )
+            return limits_[i].saturated;
+    }
+    return 0;
+}
+/* last composited position of a servo */
+int BioloidController::getOutput(int id){
+    for(int i=0; i<poseSize; i++){
+        if( id_[i] == id )
+            return (lastpose_[i] == BIOLOID_UNKNOWN) ? -1 : lastpose_[i];
+    }
+    return -1;
+}
+/* enable background readback into a caller-supplied table of capacity() entries,
+    spending at most BUDGET microseconds of each frame. NULL disables readback. */
+void BioloidController::setFeedback(bioloid_feedback_t * feedback, unsigned int budget){
+    feedback_ = feedback;
+    budget_ = budget;
+    readIndex_ = 0;
+    if(feedback_ == NULL) return;
+    for(int i=0; i<capacity_; i++){
+        feedback_[i].position = -1;
+        feedback_[i].error = 0;
+    }
+}
+/* last measured position of a servo, -1 if it has not been read yet */
+int BioloidController::getMeasured(int id){
+    if(feedback_ == NULL) return -1;
+    for(int i=0; i<poseSize; i++){
+        if( id_[i] == id )
+            return feedback_[i].position;
+    }
+    return -1;
+}
+/* last measured position minus commanded position of a servo */
+int BioloidController::getError(int id){
+    if(feedback_ == NULL) return 0;
+    for(int i=0; i<poseSize; i++){
+        if( id_[i] == id )
+            return feedback_[i].error;
+    }
+    return 0;
+}
+
+/* stream setpoints from a caller-supplied ring buffer: POSES holds DEPTH slots 
+    of STRIDE servos each, TIMES holds DEPTH deadlines. Pass NULL to disable. */
+void BioloidController::setQueue(unsigned int * poses, unsigned long * times, unsigned char depth, unsigned char stride){
+    queuePoses_ = poses;
+    queueTimes_ = times;
+    queueDepth_ = depth;
+    queueStride_ = stride;
+    queueHead_ = 0;
+    queueCount_ = 0;
+    queueEnd_ = millis();
+    underruns = 0;
+    overruns = 0;
+}
+/* queue a pose (servo units, in storage order) to be reached TIME ms after the 
+    previous setpoint, or after now if the queue has run dry. Returns 0 if full. */
+int BioloidController::queueSetpoint(const int * pose, int time){
+    if((queuePoses_ == NULL) || (poseSize > queueStride_)) return 0;
+    if(queueCount_ >= queueDepth_){
+        overruns++;
+        return 0;
+    }
+    unsigned long now = millis();
+    // keep to the host's schedule unless we have already fallen behind it
+    if((long)(queueEnd_ - now) < 0) queueEnd_ = now;
+    queueEnd_ += time;
+    unsigned char slot = (queueHead_ + queueCount_) % queueDepth_;
+    unsigned int * p = queuePoses_ + (slot * queueStride_);
+    for(int i=0; i<poseSize; i++)
+        p[i] = pose[i];
+    queueTimes_[slot] = queueEnd_;
+    queueCount_++;
+    return 1;
+}
+/* start moving to the next queued setpoint, returns 0 if there is none. */
+int BioloidController::nextSetpoint_(){
+    if(queuePoses_ == NULL) return 0;
+    if(queueCount_ == 0){
+        if(streaming_ > 0) underruns++;
+        streaming_ = 0;
+        return 0;
+    }
+    unsigned int * p = queuePoses_ + (queueHead_ * queueStride_);
+    for(int i=0; i<poseSize; i++)
+        nextpose_[i] = p[i] << BIOLOID_SHIFT;
+    long time = queueTimes_[queueHead_] - millis();
+    if(time < 0) time = 0;
+    queueHead_ = (queueHead_ + 1) % queueDepth_;
+    queueCount_--;
+    // don't restart the frame clock, the stream should be seamless
+    unsigned long frame = lastframe_;
+    interpolateSetup(time);
+    lastframe_ = frame;
+    streaming_ = 1;
+    return 1;
+}
+
+/* select how interpolations are sent to the servos. Leaving goal speed mode
+    sets goal speed back to 0 (maximum) so that frames are tracked again. */
+void BioloidController::setMode(unsigned char mode){
+    if((mode == BIOLOID_MODE_FRAMES) && (speedset_ > 0)){
+        int length = 4 + (poseSize * 3);   // 3 = id + speed(2byte)
+        int checksum = 254 + length + AX_SYNC_WRITE + 2 + AX_GOAL_SPEED_L;
+        setTXall();
+        ax12write(0xFF);
+        ax12write(0xFF);
+        ax12write(0xFE);
+        ax12write(length);
+        ax12write(AX_SYNC_WRITE);
+        ax12write(AX_GOAL_SPEED_L);
+        ax12write(2);
+        for(int i=0; i<poseSize; i++){
+            checksum += id_[i];
+            ax12write(id_[i]);
+            ax12write(0);
+            ax12write(0);
+        }
+        ax12write(0xff - (checksum % 256));
+        setRX(0);
+        speedset_ = 0;
+    }
+    mode_ = mode;
+}
+/* send goal position and goal speed of every servo that has to move, 
+    so that each one arrives at nextpose in TIME milliseconds. */
+void BioloidController::writeGoals_(int time){
+    int i;
+    unsigned int temp;
+    long speed;
+    int count = 0;
+    if(time < 1) time = 1;
+    // work out each goal once, limits count every clip
+    for(i=0; i<poseSize; i++){
+        temp = goal_(i);
+        if(temp == lastpose_[i]) continue;
+        lastpose_[i] = temp;
+        flags_[i] |= BIOLOID_GOAL_PENDING;
+        count++;
+    }
+    if(count == 0) return;
+    int length = 4 + (count * 5);   // 5 = id + pos(2byte) + speed(2byte)
+    int checksum = 254 + length + AX_SYNC_WRITE + 4 + AX_GOAL_POSITION_L;
+    setTXall();
+    ax12write(0xFF);
+    ax12write(0xFF);
+    ax12write(0xFE);
+    ax12write(length);
+    ax12write(AX_SYNC_WRITE);
+    ax12write(AX_GOAL_POSITION_L);
+    ax12write(4);
+    for(i=0; i<poseSize; i++){
+        if(!(flags_[i] & BIOLOID_GOAL_PENDING)) continue;
+        flags_[i] &= ~BIOLOID_GOAL_PENDING;
+        temp = lastpose_[i];
+        // distance we have to cover, in servo units
+        if(nextpose_[i] > pose_[i])
+            speed = (nextpose_[i] - pose_[i]) >> BIOLOID_SHIFT;
+        else
+            speed = (pose_[i] - nextpose_[i]) >> BIOLOID_SHIFT;
+        speed = (speed * pgm_read_word_near(&bioloid_models[model_(i)].speedScale))/time;
+        // goal speed of 0 means "as fast as possible", never send it
+        if(speed < 1) speed = 1;
+        if(speed > 1023) speed = 1023;
+        checksum += id_[i] + (temp&0xff) + (temp>>8) + (speed&0xff) + (speed>>8);
+        ax12write(id_[i]);
+        ax12write(temp&0xff);
+        ax12write(temp>>8);
+        ax12write(speed&0xff);
+        ax12write(speed>>8);
+    }
+    ax12write(0xff - (checksum % 256));
+    setRX(0);
+    speedset_ = 1;
+}
+/* move each servo forward one frame, without writing anything out. */
+void BioloidController::stepPose_(){
     int i;
     int complete = poseSize;
-    while(millis() - lastframe_ < BIOLOID_FRAME_LENGTH);
-    lastframe_ = millis();
+    if(fade_ != NULL) fadeStep_();
     // update each servo
     for(i=0;i<poseSize;i++){
         int diff = nextpose_[i] - pose_[i];
         if(diff == 0){
             complete--;
+        }else if((rate_[i] > 1) && (--tick_[i] > 0)){
+            // slower servo, not due this frame
         }else{
+            tick_[i] = rate_[i];
             if(diff > 0){
                 if(diff < speed_[i]){
                     pose_[i] = nextpose_[i];
@@ -149,7 +792,6 @@ void BioloidController::interpolateStep(){
         }
     }
     if(complete <= 0) interpolating = 0;
-    writePose();      
 }
 
 /* get a servo value in the current pose */
@@ -178,32 +820,248 @@ void BioloidController::setNextPose(int id, int pos){
     }
 }
 
+/* set playback rate, 8.8 fixed point (BIOLOID_RATE_ONE = authored speed). Takes 
+    effect from the next transition loaded. */
+void BioloidController::setPlaybackRate(unsigned int rate){
+    if(rate < BIOLOID_RATE_MIN) rate = BIOLOID_RATE_MIN;
+    if(rate > BIOLOID_RATE_MAX) rate = BIOLOID_RATE_MAX;
+    // the next transition is already fetched, rescale it so the change lands there
+    if(prefetched_ == BIOLOID_PREFETCH_READY){
+        long t = ((long) fetchtime_ * playRate_) / rate;
+        fetchtime_ = (t > 32767) ? 32767 : (int) t;
+        computeSpeeds_(nextpose_, fetchpose_, fetchspeed_, fetchsize_, fetchtime_);
+    }
+    playRate_ = rate;
+}
+/* play sequences COUNT more times after the first pass, BIOLOID_LOOP_FOREVER to 
+    never stop. With PINGPONG, each pass runs the opposite way to the last. */
+void BioloidController::setLoop(unsigned char count, unsigned char pingpong){
+    loopCount_ = count;
+    loops_ = count;
+    pingpong_ = pingpong;
+}
+/* scale an authored transition time by the playback rate */
+int BioloidController::scaleTime_(int time){
+    long t = ((long) time * BIOLOID_RATE_ONE) / playRate_;
+    if(t > 32767) t = 32767;
+    return (int) t;
+}
+
+/* crossfade over TIME ms when a sequence is started while another is playing. 
+    SPARE is a controller of at least our capacity, which is used to keep playing 
+    the old sequence during the fade, it never touches the bus. Frames mode only. */
+void BioloidController::setCrossfade(BioloidController * spare, int time){
+    spare_ = spare;
+    fadeTime_ = (spare == NULL) ? 0 : time;
+    fade_ = NULL;
+}
+/* hand the sequence we are playing to our spare, to fade out from */
+void BioloidController::beginFade_(){
+    fade_ = NULL;
+    if((playing == 0) || (fadeTime_ <= 0) || (mode_ != BIOLOID_MODE_FRAMES)) return;
+    if(spare_->capacity_ < poseSize) return;
+    spare_->follow_(*this);
+    fade_ = spare_;
+    fadeStart_ = millis();
+    fadeWeight_ = 0;
+}
+/* take over the sequence state of ANOTHER controller */
+void BioloidController::follow_(const BioloidController & other){
+    poseSize = other.poseSize;
+    for(int i=0; i<poseSize; i++){
+        pose_[i] = other.pose_[i];
+        nextpose_[i] = other.nextpose_[i];
+        speed_[i] = other.speed_[i];
+        fetchpose_[i] = other.fetchpose_[i];
+        fetchspeed_[i] = other.fetchspeed_[i];
+        rate_[i] = other.rate_[i];
+        tick_[i] = other.tick_[i];
+    }
+    frameLength_ = other.frameLength_;
+    mode_ = BIOLOID_MODE_FRAMES;
+    interpolating = other.interpolating;
+    playing = other.playing;
+    sequence = other.sequence;
+    seqLength_ = other.seqLength_;
+    seqIndex_ = other.seqIndex_;
+    direction_ = other.direction_;
+    loops_ = other.loops_;
+    pingpong_ = other.pingpong_;
+    playRate_ = other.playRate_;
+    packedStart_ = other.packedStart_;
+    packed_ = other.packed_;
+    packedIndex_ = other.packedIndex_;
+    far_ = other.far_;
+    prefetched_ = other.prefetched_;
+    fetchsize_ = other.fetchsize_;
+    fetchtime_ = other.fetchtime_;
+    layerCount_ = 0;
+    fade_ = NULL;
+}
+/* advance the outgoing sequence a frame and work out how far we have faded */
+void BioloidController::fadeStep_(){
+    unsigned long t = millis() - fadeStart_;
+    if(t >= (unsigned long) fadeTime_){
+        fade_ = NULL;
+        return;
+    }
+    fadeWeight_ = (t * BIOLOID_WEIGHT_ONE) / fadeTime_;
+    // as play(), without waiting or writing
+    if(fade_->playing == 0) return;
+    if(fade_->prefetched_ == 0)
+        fade_->prefetch_();
+    if(fade_->interpolating > 0)
+        fade_->stepPose_();
+    else if(fade_->prefetched_ == BIOLOID_PREFETCH_READY)
+        fade_->swap_();
+    else
+        fade_->playing = 0;
+}
+/* interpolated pose of servo I, blended with the outgoing sequence during a crossfade */
+unsigned int BioloidController::base_(int i){
+    if((fade_ == NULL) || (i >= fade_->poseSize)) return pose_[i];
+    return (unsigned int) (((long) pose_[i] * fadeWeight_ + 
+        (long) fade_->pose_[i] * (BIOLOID_WEIGHT_ONE - fadeWeight_)) >> 8);
+}
+
 /* play a sequence. */
 void BioloidController::playSeq( const transition_t  * addr ){
+    beginFade_();
     sequence = (transition_t *) addr;
-    // number of transitions left to load
-    transitions = pgm_read_word_near(&sequence->time);
+    packed_ = 0;
+    // number of transitions in the sequence
+    seqLength_ = pgm_read_word_near(&sequence->time);
     sequence++;    
-    // load a transition
+    if(seqLength_ == 0) return;
+    startSeq_();
+    // load the first transition
     loadPose((const unsigned int *)pgm_read_word_near(&sequence->pose));
-    interpolateSetup(pgm_read_word_near(&sequence->time));
-    transitions--;
+    interpolateSetup(scaleTime_(pgm_read_word_near(&sequence->time)));
+}
+/* play a packed sequence: servo count, transition count, then for each transition
+    a 16-bit time and a pose record. The first pose is absolute, the rest are deltas. */
+void BioloidController::playSeq( const unsigned char * addr ){
+    beginFade_();               // the spare takes our far_ with the old sequence
+    far_ = 0;
+    playPacked_((unsigned long) addr);
+}
+/* call beginFade_() first */
+void BioloidController::playPacked_( unsigned long addr ){
+    poseSize = readByte_(addr);
+    seqLength_ = readByte_(addr+1);
+    if(seqLength_ == 0) return;
+    startSeq_();
+    packedStart_ = addr + 2;
+    interpolateSetup(scaleTime_(seekPacked_(0, nextpose_)));
+}
+/* reset the sequence engine to the first transition */
+void BioloidController::startSeq_(){
+    seqIndex_ = 0;
+    direction_ = 1;
+    loops_ = loopCount_;
+    prefetched_ = 0;
     playing = 1;
 }
+/* decode transition INDEX of the packed sequence into DEST, from the start as 
+    each pose is stored relative to the one before. Leaves packed_ at the next 
+    transition and returns the time of this one. */
+int BioloidController::seekPacked_(int index, unsigned int * dest){
+    int time = 0;
+    unsigned long addr = packedStart_;
+    for(int i=0; i<=index; i++){
+        time = readByte_(addr) + (readByte_(addr+1)<<8);
+        addr = unpackPose_(addr+2, (i == 0), dest);
+    }
+    packed_ = addr;
+    packedIndex_ = index + 1;
+    return time;
+}
+/* decode the next transition into the back buffers and work out its speeds, 
+    it will start from the pose the current transition ends in. */
+void BioloidController::prefetch_(){
+    int next = seqIndex_ + direction_;
+    if((next < 0) || (next >= seqLength_)){
+        // end of a pass
+        if(loops_ == 0){
+            prefetched_ = BIOLOID_PREFETCH_DONE;
+            return;
+        }
+        if(loops_ != BIOLOID_LOOP_FOREVER)
+            loops_--;
+        if(pingpong_ > 0){
+            direction_ = -direction_;
+            next = seqIndex_ + direction_;
+            if((next < 0) || (next >= seqLength_)) next = seqIndex_;
+        }else{
+            next = 0;
+        }
+    }
+    // going forward, a transition takes its own time to reach its pose. Going 
+    //  back, we retrace the transition that left the pose, and take its time. 
+    //  A single transition has nothing to retrace, it is replayed as is.
+    unsigned char back = (direction_ < 0) && (seqLength_ > 1);
+    int time;
+    if(packed_ != 0){
+        if((direction_ > 0) && (next > 0) && (next == packedIndex_)){
+            // the usual case, apply the deltas to where we are going now
+            for(int i=0; i<poseSize; i++)
+                fetchpose_[i] = nextpose_[i];
+            time = readByte_(packed_) + (readByte_(packed_+1)<<8);
+            packed_ = unpackPose_(packed_+2, 0, fetchpose_);
+            packedIndex_++;
+        }else{
+            time = seekPacked_(next, fetchpose_);
+            if(back)
+                time = readByte_(packed_) + (readByte_(packed_+1)<<8);
+        }
+        fetchsize_ = poseSize;
+    }else{
+        fetchsize_ = loadRaw_((const unsigned int *)pgm_read_word_near(&sequence[next].pose), fetchpose_);
+        if(back)
+            time = pgm_read_word_near(&sequence[next+1].time);
+        else
+            time = pgm_read_word_near(&sequence[next].time);
+    }
+    seqIndex_ = next;
+    fetchtime_ = scaleTime_(time);
+    computeSpeeds_(nextpose_, fetchpose_, fetchspeed_, fetchsize_, fetchtime_);
+    prefetched_ = BIOLOID_PREFETCH_READY;
+}
+/* make the prefetched transition current, by swapping buffers */
+void BioloidController::swap_(){
+    unsigned int * pose = nextpose_;
+    int * speed = speed_;
+    nextpose_ = fetchpose_;
+    fetchpose_ = pose;
+    speed_ = fetchspeed_;
+    fetchspeed_ = speed;
+    poseSize = fetchsize_;
+    prefetched_ = 0;
+    interpolating = 1;
+    if(mode_ == BIOLOID_MODE_GOAL_SPEED)
+        writeGoals_(fetchtime_);
+}
 /* keep playing our sequence */
 void BioloidController::play(){
     if(playing == 0) return;
     if(interpolating > 0){
+        // get the next transition ready while we wait for the frame
+        if(prefetched_ == 0)
+            prefetch_();
         interpolateStep();
     }else{  // move onto next pose
-        sequence++;   
-        if(transitions > 0){
-            loadPose((const unsigned int *)pgm_read_word_near(&sequence->pose));
-            interpolateSetup(pgm_read_word_near(&sequence->time));
-            transitions--;
+        if(prefetched_ == 0)
+            prefetch_();
+        if(prefetched_ == BIOLOID_PREFETCH_READY){
+            swap_();
         }else{
             playing = 0;
+            if(fade_ != NULL){
+                // done before the fade is, land on our own pose rather than the blend
+                fade_ = NULL;
+                if(mode_ == BIOLOID_MODE_FRAMES)
+                    writePose();
+            }
         }
     }
 }
-
@@ -24,15 +24,88 @@
  *  PROGMEM prog_uint16_t name[ ] = {4,512,512,482,542}; // first number is # of servos
  * sequences:
  *  PROGMEM transition_t name[] = {{NULL,count},{pose_name,1000},...} 
+ * packed pose sets and sequences (see extras/packposes.py):
+ *  PROGMEM prog_uchar poses[] = {servos, count, pose0 (16-bit), pose1 (8-bit deltas), ...};
+ *  PROGMEM prog_uchar name[] = {servos, count, time, pose0 (16-bit), time, pose1 (8-bit deltas), ...};
  */
 
 #include "ax12.h"
 
+/* parts with more than 64K of FLASH (ArbotiX+ 1280) can keep motions anywhere, 
+    using 32-bit addresses from pgm_get_far_address(). BIOLOID_PROGMEM_FAR puts 
+    data after the code, so it doesn't crowd code and strings out of the low 64K
+    (.fini7 is only run if main() returns, which Arduino's never does):
+     const unsigned char walk[] BIOLOID_PROGMEM_FAR = {...};  // packposes.py --far
+     bioloid.playSeqFar(pgm_get_far_address(walk));
+ */
+#if defined(RAMPZ)
+  #define BIOLOID_FAR
+  #define BIOLOID_PROGMEM_FAR     __attribute__((__section__(".fini7")))
+  #ifndef pgm_get_far_address
+    // from avr-libc 1.8.0
+    #define pgm_get_far_address(var)                \
+    ({                                              \
+        uint_farptr_t tmp;                          \
+        __asm__ __volatile__(                       \
+            "ldi    %A0, lo8(%1)"   "\n\t"          \
+            "ldi    %B0, hi8(%1)"   "\n\t"          \
+            "ldi    %C0, hh8(%1)"   "\n\t"          \
+            "clr    %D0"            "\n\t"          \
+            : "=d" (tmp)                            \
+            : "p" (&(var))                          \
+        );                                          \
+        tmp;                                        \
+    })
+  #endif
+#endif
+
 /* pose engine runs at 30Hz (33ms between frames) 
    recommended values for interpolateSetup are of the form X*BIOLOID_FRAME_LENGTH - 1 */
 #define BIOLOID_FRAME_LENGTH      33
 /* we need some extra resolution, use 13 bits, rather than 10, during interpolation */
 #define BIOLOID_SHIFT             3
+/* interpolation modes: 
+    FRAMES streams an intermediate position every frame, 
+    GOAL_SPEED sends goal position and goal speed once and lets the servos interpolate */
+#define BIOLOID_MODE_FRAMES       0
+#define BIOLOID_MODE_GOAL_SPEED   1
+/* AX goal speed units per (position unit per millisecond), 1 unit = 0.111rpm = 2.27 positions/s */
+#define BIOLOID_SPEED_SCALE       440
+
+/* sequence playback rate, 8.8 fixed point: 64 = quarter speed, 1024 = 4x */
+#define BIOLOID_RATE_ONE          256
+#define BIOLOID_RATE_MIN          64
+#define BIOLOID_RATE_MAX          1024
+/* full weight of a layer, 8.8 fixed point */
+#define BIOLOID_WEIGHT_ONE        256
+/* setLoop() count that never runs out */
+#define BIOLOID_LOOP_FOREVER      0xFF
+
+/* state of the sequence engine's look-ahead */
+#define BIOLOID_PREFETCH_READY    1
+#define BIOLOID_PREFETCH_DONE     2         // nothing left to play
+
+/* bytes of per-servo storage: pose, nextpose, lastpose, fetchpose, speed, fetchspeed, id, flags, rate and tick */
+#define BIOLOID_SERVO_BYTES       (4*sizeof(unsigned int) + 2*sizeof(int) + 4*sizeof(unsigned char))
+#define BIOLOID_STORAGE(n)        ((n) * BIOLOID_SERVO_BYTES)
+/* last transmitted value of a servo that has not been written since setup/readPose */
+#define BIOLOID_UNKNOWN           0xFFFF
+/* per-servo flags */
+#define BIOLOID_READ_FAILED       0x01      // servo did not answer the last readPose()
+#define BIOLOID_MODEL_MASK        0x06      // BIOLOID_MODEL_* of the servo
+#define BIOLOID_MODEL_BIT         1
+#define BIOLOID_GOAL_PENDING      0x08      // goal in lastpose_ still to be sent, writeGoals_()
+
+/* servo models, see bioloid_models[] for their traits. The extra resolution of 
+   BIOLOID_SHIFT is kept for all, as 12-bit positions still fit in 15 bits. */
+#define BIOLOID_MODEL_AX          0         // 10-bit, the default
+#define BIOLOID_MODEL_MX          1         // 12-bit
+
+/* in packed poses, a delta of -128 is followed by an absolute 16-bit position */
+#define BIOLOID_PACK_ESCAPE       -128
+
+/* don't start a feedback read with less than this many ms left in the frame */
+#define BIOLOID_READ_MARGIN       3
 
 /** a structure to hold transitions **/
 typedef struct{
@@ -40,6 +113,36 @@ typedef struct{
     int time;               // time for transition
 } transition_t; 
 
+/** traits of a servo model, kept in FLASH **/
+typedef struct{
+    unsigned int max;       // highest position
+    unsigned int center;    // position at center of travel
+    unsigned int speedScale;// goal speed units per (position unit per millisecond)
+} bioloid_model_t;
+
+/** an additive layer of offsets on top of the interpolated pose **/
+typedef struct{
+    int * offset;           // per storage index offset in servo units, NULL to skip this layer
+    int weight;             // 8.8 fixed point, BIOLOID_WEIGHT_ONE adds the full offset
+} bioloid_layer_t;
+
+/** soft limits of one servo, the first four are set by the user **/
+typedef struct{
+    unsigned int min;       // lowest position allowed
+    unsigned int max;       // highest position allowed
+    unsigned int velocity;  // positions/s, 0 = no limit
+    unsigned int accel;     // positions/s^2, 0 = no limit
+    unsigned int position;  // last output, shifted
+    int speed;              // last change of output per frame, shifted
+    unsigned int saturated; // number of times a limit was hit
+} bioloid_limits_t;
+
+/** a structure to hold position feedback for one servo **/
+typedef struct{
+    int position;           // last present position read, -1 if never read
+    int error;              // position - commanded position
+} bioloid_feedback_t;
+
 /** Bioloid Controller Class for mega324p/644p clients. **/
 class BioloidController
 {
@@ -48,13 +151,18 @@ class BioloidController
     BioloidController(long baud);               // baud usually 1000000
     
     /* New-style constructor/setup */ 
-    BioloidController() {};
-    void setup(int servo_cnt);
+    BioloidController();
+    int setup(int servo_cnt);                   // (re)initialize, only allocates if servo_cnt grows, returns servos set up
+    int setup(int servo_cnt, void * storage);   // (re)initialize using BIOLOID_STORAGE(servo_cnt) bytes
+    int capacity(){ return capacity_; }         // how many servos our storage can hold
 
     /* Pose Manipulation */
     void loadPose( const unsigned int * addr ); // load a named pose from FLASH  
-    void readPose();                            // read a pose in from the servos  
-    void writePose();                           // write a pose out to the servos
+    void loadPose( const unsigned char * addr, int index ); // load a pose from a packed set in FLASH
+    int readPose();                             // read a pose in from the servos, returns # of failures
+    int readFailed(int index);                  // did this storage index fail the last readPose()?
+    void writePose();                           // write changed servos out using sync write
+    void invalidatePose();                      // force next writePose() to send every servo
     int getCurPose(int id);                     // get a servo value in the current pose
     int getNextPose(int id);                    // get a servo value in the next pose
     void setNextPose(int id, int pos);          // set a servo value in the next pose
@@ -67,6 +175,14 @@ class BioloidController
     unsigned char interpolating;                // are we in an interpolation? 0=No, 1=Yes
     unsigned char runningSeq;                   // are we running a sequence? 0=No, 1=Yes 
     int poseSize;                               // how many servos are in this pose, used by Sync()
+    void setMode(unsigned char mode);           // BIOLOID_MODE_FRAMES or BIOLOID_MODE_GOAL_SPEED
+    unsigned char getMode(){ return mode_; }
+    void setFrameLength(unsigned char ms);      // time between frames, BIOLOID_FRAME_LENGTH by default
+    void setRate(int id, unsigned char divider);// only update this servo every DIVIDER frames
+    void setModel(int id, unsigned char model); // BIOLOID_MODEL_AX (default) or BIOLOID_MODEL_MX
+    int getModel(int id);                       // model of a servo, -1 if not in our pose
+    int discoverModels();                       // set models from the servos, returns # of failures
+    int getCenter(int id);                      // center position of a servo, for its model
 
     /* to interpolate:
      *  bioloid.loadPose(myPose);
@@ -75,30 +191,216 @@ class BioloidController
      *      bioloid.interpolateStep();
      *      delay(1);
      *  }
+     * to mix rates, run the controller fast and slow down the servos that don't need it:
+     *  bioloid.setFrameLength(10);             // 100Hz frames
+     *  bioloid.setRate(LEG_SERVO, 3);          // 33Hz for this servo
+     * for a WidowX with MX shoulders and AX wrists, after setup():
+     *  arm.discoverModels();                   // or arm.setModel(id, BIOLOID_MODEL_MX)
+     * for long, slow moves call bioloid.setMode(BIOLOID_MODE_GOAL_SPEED) first, 
+     *  the same loop then only sends one packet per transition.
+     */
+
+    /* Feedback, read back while waiting for the next frame */
+    void setFeedback(bioloid_feedback_t * feedback, unsigned int budget); 
+    int getMeasured(int id);                    // last measured position of a servo, -1 if unknown
+    int getError(int id);                       // measured - commanded position of a servo
+
+    /* Layers, composited each frame just before the pose is written */
+    void setLayers(bioloid_layer_t * layers, unsigned char count, unsigned int * output);
+    int getOutput(int id);                      // last position sent to a servo, pose plus layers, -1 if none yet
+
+    /* to walk with body IK offsets and user trims on top:
+     *  int ik[18], trims[18]; unsigned int out[18];
+     *  bioloid_layer_t layers[2] = {{ik, BIOLOID_WEIGHT_ONE}, {trims, BIOLOID_WEIGHT_ONE}};
+     *  bioloid.setLayers(layers, 2, out);
+     *  bioloid.playSeq(walk);                  // ik[] and trims[] may change at any time
+     * while layers are set, interpolateStep() keeps sending frames when the pose is 
+     * still, so a moving layer is followed without restarting the interpolation.
+     */
+
+    /* Limits, enforced on every frame and goal sent out */
+    void setLimits(bioloid_limits_t * limits);
+    unsigned int getSaturated(int id);          // times this servo has been clipped
+
+    /* to keep a leg in range and its moves gentle:
+     *  bioloid_limits_t limits[18];            // fill in min, max, velocity and accel
+     *  bioloid.setLimits(limits);
+     *  if(bioloid.getSaturated(LEG_SERVO) > 0) ...
+     */
+
+    /* Setpoint Queue, consumed by interpolateStep() */
+    void setQueue(unsigned int * poses, unsigned long * times, unsigned char depth, unsigned char stride);
+    int queueSetpoint(const int * pose, int time);  // reach pose TIME ms after the last setpoint
+    unsigned char queued(){ return queueCount_; }   // setpoints waiting
+    unsigned int underruns;                     // times the queue ran dry while streaming
+    unsigned int overruns;                      // setpoints dropped because the queue was full
+
+    /* to stream setpoints:
+     *  unsigned int poses[4*6]; unsigned long times[4];
+     *  arm.setQueue(poses, times, 4, 6);
+     *  arm.queueSetpoint(target, 100);         // whenever the host sends one
+     *  arm.interpolateStep();                  // every pass through loop()
      */
 
     /* Sequence Engine */
     void playSeq( const transition_t * addr );  // load a sequence and play it from FLASH
+    void playSeq( const unsigned char * addr ); // load a packed sequence and play it from FLASH
+#ifdef BIOLOID_FAR
+    /* packed sequences carry their poses inline, so they need no pointers and can
+       live anywhere in FLASH. Raw transition_t tables must stay in the low 64K. */
+    void loadPoseFar( uint_farptr_t addr );     // load a named pose from anywhere in FLASH
+    void loadPoseFar( uint_farptr_t addr, int index ); // load a pose from a packed set anywhere in FLASH
+    void playSeqFar( uint_farptr_t addr );      // play a packed sequence from anywhere in FLASH
+#endif
     void play();                                // keep moving forward in time
     unsigned char playing;                      // are we playing a sequence? 0=No, 1=Yes
+    void setPlaybackRate(unsigned int rate);    // speed multiplier, BIOLOID_RATE_ONE is as authored, from the next transition
+    unsigned int getPlaybackRate(){ return playRate_; }
+    void setLoop(unsigned char count, unsigned char pingpong = 0); // repeat passes, optionally back and forth
+    void setCrossfade(BioloidController * spare, int time); // fade between sequences over TIME ms
+    unsigned char fading(){ return (fade_ != NULL); }
+    unsigned char loopsLeft(){ return loops_; } // passes left after this one
 
     /* to run the sequence engine:
      *  bioloid.playSeq(walk);
      *  while(bioloid.playing){
      *      bioloid.play();
      *  }
+     * one gait at any walking speed, until told to stop:
+     *  bioloid.setPlaybackRate(BIOLOID_RATE_ONE*3/2);
+     *  bioloid.setLoop(BIOLOID_LOOP_FOREVER);
+     *  bioloid.playSeq(walk);
+     *  ...
+     *  bioloid.setLoop(0);                     // finish this pass, then stop
+     * to turn without stopping the walk first:
+     *  StaticBioloidController<18> spare;      // plays the old sequence during a fade
+     *  bioloid.setCrossfade(&spare, 500);
+     *  bioloid.playSeq(turn);                  // blends from walk to turn over 500ms
      */
     
   private:  
+    friend class BioloidGroup;                  // groups merge our frames into their own sync write
+    void stepPose_();                           // advance the interpolation one frame, no output
+    int changed_();                             // number of servos changed since last write
+    int writeChanged_();                        // send changed servos, returns their checksum
+    void writeSync_(int count);                 // sync write COUNT changed servos, as found by changed_()
+    int unsent_();                              // servos whose output differs from lastpose_, no limiting
+    unsigned char model_(int i){ return (flags_[i] & BIOLOID_MODEL_MASK) >> BIOLOID_MODEL_BIT; }
+    void setModel_(int i, unsigned char model); // set the model, re-centering a servo still at its default
+    unsigned int center_(int i);                // center of the servo's model, shifted
+    unsigned int composite_(int i, unsigned int base); // base plus weighted layers, shifted
+    unsigned int limit_(int i, unsigned int pos);  // apply limits to a shifted position
+    unsigned int out_(int i);                   // position to send this frame
+    unsigned int goal_(int i);                  // goal position in goal speed mode
+    void reset_();                              // no storage, no optional features
+    void attach_(void * storage, int servo_cnt);// point our arrays into a block of storage
+    int allocate_(int servo_cnt);               // get storage from the heap, 0 if there is none
+    void init_(int servo_cnt);                  // reset ids and poses
+    void writeGoals_(int time);                 // send goal position + goal speed (GOAL_SPEED mode)
+    void waitFrame_();                          // wait for the next frame, reading feedback meanwhile
+    void readNext_();                           // read back the next servo, round-robin
+    int nextSetpoint_();                        // start on the next queued setpoint, 0 if none
+    unsigned char readByte_( unsigned long addr ); // read FLASH, near or far
+    int loadRaw_( const unsigned int * addr, unsigned int * dest );
+    unsigned long unpackPose_( unsigned long addr, unsigned char absolute, unsigned int * dest );
+    void loadPacked_( unsigned long addr, int index );
+    void playPacked_( unsigned long addr );
+    void computeSpeeds_(const unsigned int * from, const unsigned int * to, int * speed, int count, int time);
+    void startSeq_();                           // rewind the sequence engine and start playing
+    int seekPacked_(int index, unsigned int * dest);
+    int scaleTime_(int time);                   // apply the playback rate
+    void beginFade_();                          // start fading out of the sequence we are playing
+    void follow_(const BioloidController & other); // copy sequence state, to play it as a spare
+    void fadeStep_();                           // advance the outgoing sequence one frame
+    unsigned int base_(int i);                  // interpolated pose, blended while fading
+    void prefetch_();                           // decode the next transition into the back buffers
+    void swap_();                               // flip to the prefetched transition
+
     unsigned int * pose_;                       // the current pose, updated by Step(), set out by Sync()
     unsigned int * nextpose_;                   // the destination pose, where we put on load
     int * speed_;                               // speeds for interpolation 
+    unsigned int * fetchpose_;                  // next transition of a sequence, decoded ahead
+    int * fetchspeed_;                          // speeds for fetchpose_
+    unsigned int * lastpose_;                   // last value sent to each servo, not shifted
     unsigned char * id_;                        // servo id for this index
+    unsigned char * flags_;                     // BIOLOID_READ_FAILED, etc
+    unsigned char * rate_;                      // frames between updates of this servo
+    unsigned char * tick_;                      // frames until this servo is next updated
+    void * storage_;                            // block holding all of the above
+    int capacity_;                              // number of servos storage_ can hold
+    unsigned char owned_;                       // did we malloc storage_? 
 
     unsigned long lastframe_;                   // time last frame was sent out  
+    unsigned char frameLength_;                 // ms between frames
+    unsigned char mode_;                        // BIOLOID_MODE_FRAMES or BIOLOID_MODE_GOAL_SPEED
+    unsigned char speedset_;                    // have we left servos with a non-zero goal speed?
+
+    bioloid_feedback_t * feedback_;             // measured positions, NULL if not reading back
+    unsigned int budget_;                       // microseconds per frame we may spend reading
+    int readIndex_;                             // next servo to read back
+
+    bioloid_layer_t * layers_;                  // additive layers, NULL if none
+    unsigned char layerCount_;                  // number of layers
+    unsigned int * output_;                     // pose plus layers, as last composited
+    bioloid_limits_t * limits_;                 // soft limits, NULL if none
+    unsigned char limiting_;                    // is the output still catching up with the pose?
+
+    BioloidController * spare_;                 // engine for the outgoing sequence of a crossfade
+    BioloidController * fade_;                  // spare_ while fading, else NULL
+    int fadeTime_;                              // crossfade window, ms, 0 = off
+    unsigned long fadeStart_;                   // when the current fade started
+    int fadeWeight_;                            // weight of the new sequence, 8.8 fixed point
+
+    unsigned int * queuePoses_;                 // setpoint ring buffer, NULL if not streaming
+    unsigned long * queueTimes_;                // when each setpoint should be reached
+    unsigned char queueDepth_;                  // number of slots
+    unsigned char queueStride_;                 // servos per slot
+    unsigned char queueHead_;                   // oldest queued slot
+    unsigned char queueCount_;                  // number of queued slots
+    unsigned char streaming_;                   // are we moving to a queued setpoint?
+    unsigned long queueEnd_;                    // deadline of the last queued setpoint
     
-    transition_t * sequence;                    // sequence we are running
-    int transitions;                            // how many transitions we have left to load
+    transition_t * sequence;                    // first transition of the sequence we are running
+    int seqLength_;                             // number of transitions in the sequence
+    int seqIndex_;                              // last transition loaded
+    signed char direction_;                     // 1 = forward, -1 = back (ping-pong)
+    unsigned char loops_;                       // passes left after this one
+    unsigned char loopCount_;                   // passes set by setLoop()
+    unsigned char pingpong_;                    // reverse at each end rather than restart?
+    unsigned int playRate_;                     // 8.8 fixed point speed multiplier
+    unsigned long packedStart_;                 // first transition of a packed sequence
+    unsigned long packed_;                      // next transition of a packed sequence, else 0
+    int packedIndex_;                           // index of the transition at packed_
+    unsigned char far_;                         // is packed_ a far address?
+    unsigned char prefetched_;                  // BIOLOID_PREFETCH_READY if the next transition is in fetchpose_
+    int fetchsize_;                             // servos in fetchpose_
+    int fetchtime_;                             // time of the transition in fetchpose_
    
 };
+
+/** Pose engine with in-object storage for N servos, no heap is used:
+ *   StaticBioloidController<18> bioloid(1000000);
+ *  or, as with the new-style controller, without touching the bus:
+ *   StaticBioloidController<6> arm;
+ *   arm.setup(6);
+ */
+template<int N>
+class StaticBioloidController : public BioloidController
+{
+  public:
+    StaticBioloidController(){ 
+        BioloidController::setup(N, storage_); 
+        poseSize = 0;
+    }
+    StaticBioloidController(long baud){
+        BioloidController::setup(N, storage_);
+        poseSize = 0;
+        ax12Init(baud);
+    }
+    int setup(int servo_cnt){ return BioloidController::setup(servo_cnt > N ? N : servo_cnt, storage_); }
+    
+  private:
+    StaticBioloidController(const StaticBioloidController &);  // arrays point into this object, no copies
+    unsigned char storage_[BIOLOID_STORAGE(N)];
+};
 #endif
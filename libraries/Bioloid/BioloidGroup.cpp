@@ -0,0 +1,162 @@
+/*
+  BioloidGroup.cpp - ArbotiX Library for merging several pose engines into one bus frame
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "BioloidGroup.h"
+
+BioloidGroup::BioloidGroup(){
+    count_ = 0;
+    budget_ = 0;
+    spent_ = 0;
+    next_ = 0;
+    lastframe_ = millis();
+}
+
+void BioloidGroup::add(BioloidController * controller){
+    if(count_ < BIOLOID_GROUP_SIZE)
+        controllers_[count_++] = controller;
+}
+
+unsigned char BioloidGroup::interpolating(){
+    unsigned char n = 0;
+    for(int i=0; i<count_; i++){
+        if(controllers_[i]->interpolating > 0)
+            n++;
+    }
+    return n;
+}
+
+/* wait for the next frame, letting the active controllers read back feedback 
+    in turn until the bus budget for this frame is spent. */
+void BioloidGroup::waitFrame_(unsigned char active){
+    unsigned long start = micros();
+    unsigned char next = 0;
+    unsigned char length = frameLength_(active);
+    while(millis() - lastframe_ < length){
+        if((budget_ == 0) || (micros() - start >= budget_) ||
+           (millis() - lastframe_ + BIOLOID_READ_MARGIN >= length))
+            continue;
+        BioloidController * c = controllers_[next];
+        if((active & (1<<next)) && (c->feedback_ != NULL))
+            c->readNext_();
+        if(++next >= count_) next = 0;
+    }
+}
+
+/* members should share a frame length, if not, keep up with the fastest */
+unsigned char BioloidGroup::frameLength_(unsigned char active){
+    unsigned char length = 255;
+    for(int i=0; i<count_; i++){
+        if((active & (1<<i)) && (controllers_[i]->frameLength_ < length))
+            length = controllers_[i]->frameLength_;
+    }
+    return length;
+}
+
+/* bitmask of the controllers that have something to send this frame */
+unsigned char BioloidGroup::active_(){
+    unsigned char active = 0;
+    for(int i=0; i<count_; i++){
+        if((controllers_[i]->interpolating > 0) || (controllers_[i]->nextSetpoint_() > 0) ||
+           (controllers_[i]->layerCount_ > 0) || (controllers_[i]->limiting_ > 0) || 
+           (controllers_[i]->fade_ != NULL))
+            active |= (1<<i);
+    }
+    return active;
+}
+
+/* step all interpolating controllers, and send their changed servos in a single packet. */
+void BioloidGroup::interpolateStep(){
+    unsigned char active = active_();
+    if(active == 0) return;
+    waitFrame_(active);
+    lastframe_ = millis();
+    step_(active);
+}
+
+/* non-blocking interpolateStep() for cooperative loops, returns 1 if a frame was sent. 
+    Frames fall on a fixed grid, so a caller on a timer of the same period (a TaskLoop 
+    task, say) locks onto it after at most one skipped frame. Meanwhile each call may 
+    make one feedback read, within the read budget. */
+int BioloidGroup::update(){
+    unsigned char active = active_();
+    if(active == 0) return 0;
+    unsigned char length = frameLength_(active);
+    unsigned long now = millis();
+    if(now - lastframe_ < length){
+        if((budget_ > 0) && (spent_ < budget_) && (now - lastframe_ + BIOLOID_READ_MARGIN < length)){
+            unsigned long start = micros();
+            BioloidController * c = controllers_[next_];
+            if((active & (1<<next_)) && (c->feedback_ != NULL))
+                c->readNext_();
+            if(++next_ >= count_) next_ = 0;
+            spent_ += micros() - start;
+        }
+        return 0;
+    }
+    lastframe_ += length;
+    if(now - lastframe_ >= length)
+        lastframe_ = now;       // idle or fell behind, start a new grid
+    spent_ = 0;
+    step_(active);
+    return 1;
+}
+
+/* step the ACTIVE controllers and send their frame */
+void BioloidGroup::step_(unsigned char active){
+    int i;
+    int count = 0;
+    unsigned char sending = 0;  // bitmask of controllers that stream frames
+    for(i=0; i<count_; i++){
+        if(active & (1<<i)){
+            controllers_[i]->stepPose_();
+            controllers_[i]->lastframe_ = lastframe_;
+            // goal speed controllers have already sent their goals
+            if(controllers_[i]->mode_ == BIOLOID_MODE_FRAMES){
+                sending |= (1<<i);
+                count += controllers_[i]->changed_();
+            }
+        }
+    }
+    if(count == 0) return;
+    if(count > BIOLOID_SYNC_MAX){
+        // too big for one packet, fall back to a packet per controller. 
+        //  changed_() already limited this frame, only count what it left to send
+        for(i=0; i<count_; i++){
+            if(sending & (1<<i))
+                controllers_[i]->writeSync_(controllers_[i]->unsent_());
+        }
+        return;
+    }
+    int length = 4 + (count * 3);   // 3 = id + pos(2byte)
+    int checksum = 254 + length + AX_SYNC_WRITE + 2 + AX_GOAL_POSITION_L;
+    setTXall();
+    ax12write(0xFF);
+    ax12write(0xFF);
+    ax12write(0xFE);
+    ax12write(length);
+    ax12write(AX_SYNC_WRITE);
+    ax12write(AX_GOAL_POSITION_L);
+    ax12write(2);
+    for(i=0; i<count_; i++){
+        if(sending & (1<<i))
+            checksum += controllers_[i]->writeChanged_();
+    }
+    ax12write(0xff - (checksum % 256));
+    setRX(0);
+}
@@ -0,0 +1,66 @@
+/*
+  BioloidGroup.h - ArbotiX Library for merging several pose engines into one bus frame
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BioloidGroup_h
+#define BioloidGroup_h
+
+#include "BioloidController.h"
+
+/* most controllers a group can hold */
+#define BIOLOID_GROUP_SIZE        5
+/* most servos in one sync write, the length byte is 4 + 3*servos */
+#define BIOLOID_SYNC_MAX          83
+
+/** Steps several BioloidControllers together, sending one sync write per frame. **/
+class BioloidGroup
+{
+  public:
+    BioloidGroup();
+    void add(BioloidController * controller);   // add a controller to the group
+    void interpolateStep();                     // move every interpolating controller forward one step
+    int update();                               // as interpolateStep(), but returns at once if no frame is due
+    unsigned char interpolating();              // number of controllers still interpolating
+    void setReadBudget(unsigned int budget){ budget_ = budget; }  // us per frame for feedback reads
+
+    /* to run a group:
+     *  group.add(&arm);
+     *  group.add(&head);
+     *  arm.interpolateSetup(500);
+     *  head.interpolateSetup(200);
+     *  while(group.interpolating() > 0){
+     *      group.interpolateStep();
+     *  }
+     *  ...or from a task run every BIOLOID_FRAME_LENGTH ms, without blocking:
+     *  group.update();
+     */
+
+  private:
+    void waitFrame_(unsigned char active);      // wait for the next frame, reading feedback meanwhile
+    unsigned char active_();                    // controllers with something to send
+    unsigned char frameLength_(unsigned char active);
+    void step_(unsigned char active);           // step and send one frame
+
+    BioloidController * controllers_[BIOLOID_GROUP_SIZE];
+    unsigned char count_;                       // how many controllers are in the group
+    unsigned long lastframe_;                   // time last frame was sent out
+    unsigned int budget_;                       // us per frame members may spend reading feedback
+    unsigned int spent_;                        // us read so far this frame, update()
+    unsigned char next_;                        // member to read next, update()
+};
+#endif
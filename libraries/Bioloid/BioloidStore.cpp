@@ -0,0 +1,94 @@
+/*
+  BioloidStore.cpp - ArbotiX Library for keeping poses and a sequence in EEPROM
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "BioloidStore.h"
+
+#define STORE_POSES             (STORE_HEADER + 3*STORE_SEQ_MAX)
+
+BioloidStore::BioloidStore(unsigned int base){
+    base_ = base;
+    poseSize_ = 0;
+    flags_ = 0;
+    valid_ = 1;                 // don't know yet, the first write clears it
+}
+
+void BioloidStore::begin(unsigned char pose_size){
+    invalidate_();
+    poseSize_ = pose_size;
+}
+
+void BioloidStore::invalidate_(){
+    if(valid_ == 0) return;
+    eeprom_update_byte((uint8_t *) base_, 0);
+    valid_ = 0;
+}
+
+/* read the header, returns the pose size of a committed store, 0 if there is none */
+unsigned char BioloidStore::load(){
+    if(eeprom_read_byte((uint8_t *) base_) != STORE_MAGIC) return 0;
+    poseSize_ = eeprom_read_byte((uint8_t *) (base_+1));
+    flags_ = eeprom_read_byte((uint8_t *) (base_+2));
+    valid_ = 1;
+    return poseSize_;
+}
+/* write the header. Only changed bytes are written, EEPROM writes take ~3.3ms each. */
+void BioloidStore::commit(unsigned char flags){
+    flags_ = flags;
+    eeprom_update_byte((uint8_t *) (base_+1), poseSize_);
+    eeprom_update_byte((uint8_t *) (base_+2), flags_);
+    eeprom_update_byte((uint8_t *) base_, STORE_MAGIC);
+    valid_ = 1;
+}
+
+int BioloidStore::maxPoses(){
+    if(poseSize_ == 0) return 0;
+    return (E2END + 1 - base_ - STORE_POSES) / (2*poseSize_);
+}
+
+void BioloidStore::setPosition(int pose, int servo, int value){
+    if((pose >= maxPoses()) || (servo >= poseSize_)) return;
+    invalidate_();
+    eeprom_update_word((uint16_t *) (base_ + STORE_POSES + 2*(pose*poseSize_ + servo)), value);
+}
+int BioloidStore::getPosition(int pose, int servo){
+    return eeprom_read_word((uint16_t *) (base_ + STORE_POSES + 2*(pose*poseSize_ + servo)));
+}
+
+void BioloidStore::setTransition(int index, unsigned char pose, int time){
+    if(index >= STORE_SEQ_MAX) return;
+    invalidate_();
+    unsigned int addr = base_ + STORE_HEADER + 3*index;
+    eeprom_update_byte((uint8_t *) addr, pose);
+    eeprom_update_word((uint16_t *) (addr+1), time);
+}
+unsigned char BioloidStore::getTransitionPose(int index){
+    if(index >= STORE_SEQ_MAX) return STORE_SEQ_END;
+    return eeprom_read_byte((uint8_t *) (base_ + STORE_HEADER + 3*index));
+}
+int BioloidStore::getTransitionTime(int index){
+    return eeprom_read_word((uint16_t *) (base_ + STORE_HEADER + 3*index + 1));
+}
+
+/* load a stored pose into the next pose of CONTROLLER, returns 0 if there is no such pose */
+int BioloidStore::loadPose(BioloidController * controller, int pose){
+    if(pose >= maxPoses()) return 0;
+    for(int i=0; i<poseSize_; i++)
+        controller->setNextPose(i+1, getPosition(pose, i));
+    return 1;
+}
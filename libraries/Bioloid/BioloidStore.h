@@ -0,0 +1,75 @@
+/*
+  BioloidStore.h - ArbotiX Library for keeping poses and a sequence in EEPROM
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BioloidStore_h
+#define BioloidStore_h
+
+/* layout, from the base address:
+ *  header:   magic, pose size, flags, reserved
+ *  sequence: STORE_SEQ_MAX transitions of pose index (0xff ends) and 16-bit time
+ *  poses:    as many as fit, each pose size 16-bit positions
+ * The magic is cleared by begin() or the first write after a commit, and only 
+ * set again by commit(), so a half-uploaded store is not picked up after a reset.
+ */
+
+#include <avr/eeprom.h>
+#include "BioloidController.h"
+
+#define STORE_MAGIC             0xA5
+#define STORE_HEADER            4
+#define STORE_SEQ_MAX           50
+#define STORE_SEQ_END           0xff
+/* header flags */
+#define STORE_AUTOPLAY          0x01    // play the sequence at power up
+
+/** Poses and a sequence, uploaded by a host and kept in EEPROM. **/
+class BioloidStore
+{
+  public:
+    BioloidStore(unsigned int base = 0);
+    void begin(unsigned char pose_size);        // set the pose size, this moves the poses
+    unsigned char load();                       // read the header, returns the pose size, 0 if none
+    void commit(unsigned char flags);           // make the store valid across a reset
+    unsigned char getFlags(){ return flags_; }
+    unsigned char poseSize(){ return poseSize_; }
+    int maxPoses();                             // how many poses fit at this pose size
+
+    void setPosition(int pose, int servo, int value);
+    int getPosition(int pose, int servo);
+    void setTransition(int index, unsigned char pose, int time);
+    unsigned char getTransitionPose(int index); // STORE_SEQ_END at the end of the sequence
+    int getTransitionTime(int index);
+    int loadPose(BioloidController * controller, int pose); // setNextPose() for servos 1..pose size
+
+    /* to keep motions across a reset:
+     *  store.begin(size);                      // on ARB_SIZE_POSE
+     *  store.setPosition(pose, servo, value);  // on ARB_LOAD_POSE
+     *  store.setTransition(i, pose, time);     // on ARB_LOAD_SEQ
+     *  store.commit(STORE_AUTOPLAY);           // on ARB_STORE_COMMIT
+     * and in setup(), if(store.load() > 0) ...
+     */
+
+  private:
+    unsigned int base_;                         // first EEPROM address we use
+    unsigned char poseSize_;
+    unsigned char flags_;
+    unsigned char valid_;                       // magic may be set in EEPROM
+    void invalidate_();                         // clear the magic before changing anything
+};
+#endif
@@ -120,9 +120,13 @@ ISR(USART1_RX_vect){
 /** read back the error code for our latest packet read */
 int ax12Error;
 int ax12GetLastError(){ return ax12Error; }
+/** how long to wait for each byte of a return packet, in microseconds. The first 
+    byte also has to cover the servo's return delay time (default 500us). */
+unsigned int ax12Timeout = AX12_TIMEOUT;
+void ax12SetTimeout(unsigned int us){ ax12Timeout = us; }
 /** > 0 = success */
 int ax12ReadPacket(int length){
-    unsigned long ulCounter;
+    unsigned long start;
     unsigned char offset, blength, checksum, timeout;
     unsigned char volatile bcount; 
 
@@ -130,9 +134,9 @@ int ax12ReadPacket(int length){
     timeout = 0;
     bcount = 0;
     while(bcount < length){
-        ulCounter = 0;
+        start = micros();
         while((bcount + offset) == ax_rx_int_Pointer){
-            if(ulCounter++ > 1000L){ // was 3000
+            if(micros() - start > ax12Timeout){
                 timeout = 1;
                 break;
             }
@@ -24,6 +24,7 @@
 
 #define AX12_MAX_SERVOS             30
 #define AX12_BUFFER_SIZE            32
+#define AX12_TIMEOUT                1000    // default per-byte read timeout (us)
 
 /** Configuration **/
 #if defined(ARBOTIX)
@@ -141,6 +142,7 @@ void ax12write(unsigned char data);
 void ax12writeB(unsigned char data);
 
 int ax12ReadPacket(int length);
+void ax12SetTimeout(unsigned int us);
 int ax12GetRegister(int id, int regstart, int length);
 void ax12SetRegister(int id, int regstart, int data);
 void ax12SetRegister2(int id, int regstart, int data);
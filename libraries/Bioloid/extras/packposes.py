@@ -0,0 +1,158 @@
+#!/usr/bin/env python
+
+# packposes.py - convert a poses.h file into packed pose sets and sequences
+# Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+"""
+Usage: packposes.py poses.h [packed.h] [--name poses] [--far]
+
+Reads the prog_uint16_t poses and transition_t sequences of a PyPose-style
+poses.h and writes a header using the packed format of BioloidController:
+
+  PROGMEM prog_uchar poses[] = {servos, count, pose0, pose1, ...};
+  PROGMEM prog_uchar walk[] = {servos, count, time, pose, time, pose, ...};
+
+The first pose of a set or sequence is stored as 16-bit positions, each later
+one as 8-bit deltas from the pose before it (-128 escapes to a 16-bit value).
+Poses keep their names as indexes into the set, so sketches change from
+bioloid.loadPose(stand) to bioloid.loadPose(poses, stand), while
+bioloid.playSeq(walk) works unchanged.
+
+With --far the tables are placed after the code with BIOLOID_PROGMEM_FAR, for
+the ArbotiX+ (1280), and are used with loadPoseFar(pgm_get_far_address(poses), name)
+and playSeqFar(pgm_get_far_address(walk)).
+"""
+
+import re, sys
+
+ESCAPE = -128
+
+POSE = re.compile(r"PROGMEM\s+prog_uint16_t\s+(\w+)\s*\[\s*\]\s*=\s*\{([^}]*)\}\s*;")
+SEQ = re.compile(r"PROGMEM\s+transition_t\s+(\w+)\s*\[\s*\]\s*=\s*\{(.*?)\}\s*;", re.S)
+TRANS = re.compile(r"\{\s*(\w+)\s*,\s*(\w+)\s*\}")
+
+def word(v):
+    return [v & 0xff, (v >> 8) & 0xff]
+
+def pack(pose, prev):
+    """ Pack a pose, absolute if prev is None, else as deltas from prev. """
+    out = []
+    for i in range(len(pose)):
+        if prev is None:
+            out += word(pose[i])
+            continue
+        d = pose[i] - prev[i]
+        if -127 <= d <= 127:
+            out.append(d & 0xff)
+        else:
+            out += [ESCAPE & 0xff] + word(pose[i])
+    return out
+
+def parse(text):
+    poses = []      # (name, [positions]) in file order
+    for name, body in POSE.findall(text):
+        values = [int(v, 0) for v in body.replace("\n", " ").split(",") if v.strip()]
+        if values[0] != len(values) - 1:
+            raise ValueError("pose %s: count %d does not match %d positions" % (name, values[0], len(values) - 1))
+        poses.append((name, values[1:]))
+    seqs = []       # (name, [(pose name, time)])
+    for name, body in SEQ.findall(text):
+        trans = TRANS.findall(body)
+        count = int(trans[0][1], 0)
+        seqs.append((name, [(p, int(t, 0)) for p, t in trans[1:count + 1]]))
+    return poses, seqs
+
+def table(name, data, comment, far=False):
+    if far:
+        lines = ["/* %s */" % comment, "const unsigned char %s[] BIOLOID_PROGMEM_FAR = {" % name]
+    else:
+        lines = ["/* %s */" % comment, "PROGMEM prog_uchar %s[] = {" % name]
+    for i in range(0, len(data), 16):
+        lines.append("    " + ", ".join(str(b) for b in data[i:i + 16]) + ",")
+    lines.append("};")
+    return "\n".join(lines)
+
+def convert(text, setname="poses", far=False):
+    poses, seqs = parse(text)
+    lookup = dict(poses)
+    out = ["#ifndef PACKED_POSES", "#define PACKED_POSES", "", "#include <avr/pgmspace.h>"]
+    if far:
+        out.append("#include <BioloidController.h>")
+    out.append("")
+    raw = 0
+    packed = 0
+    if poses:
+        servos = len(poses[0][1])
+        for name, pose in poses:
+            if len(pose) != servos:
+                raise ValueError("pose %s has %d servos, expected %d" % (name, len(pose), servos))
+        if len(poses) > 255:
+            raise ValueError("too many poses for one set")
+        if far:
+            out.append("/* indexes into %s, use bioloid.loadPoseFar(pgm_get_far_address(%s), name) */" % (setname, setname))
+        else:
+            out.append("/* indexes into %s, use bioloid.loadPose(%s, name) */" % (setname, setname))
+        out.append("enum { " + ", ".join(name for name, pose in poses) + " };")
+        out.append("")
+        data = [servos, len(poses)]
+        prev = None
+        for name, pose in poses:
+            data += pack(pose, prev)
+            prev = pose
+        out.append(table(setname, data, "%d poses of %d servos" % (len(poses), servos), far))
+        out.append("")
+        raw += len(poses) * (servos + 1) * 2
+        packed += len(data)
+    for name, trans in seqs:
+        if len(trans) > 255:
+            raise ValueError("sequence %s is too long" % name)
+        servos = len(lookup[trans[0][0]])
+        data = [servos, len(trans)]
+        prev = None
+        for p, t in trans:
+            data += word(t) + pack(lookup[p], prev)
+            prev = lookup[p]
+        if far:
+            use = "bioloid.playSeqFar(pgm_get_far_address(%s))" % name
+        else:
+            use = "bioloid.playSeq(%s)" % name
+        out.append(table(name, data, "sequence of %d transitions, use %s" % (len(trans), use), far))
+        out.append("")
+        raw += (len(trans) + 1) * 4
+        packed += len(data)
+    out.append("#endif")
+    return "\n".join(out) + "\n", raw, packed
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    setname = "poses"
+    far = "--far" in args
+    if far:
+        args.remove("--far")
+    if "--name" in args:
+        i = args.index("--name")
+        setname = args[i + 1]
+        del args[i:i + 2]
+    if len(args) < 1:
+        print(__doc__)
+        sys.exit(1)
+    text, raw, packed = convert(open(args[0]).read(), setname, far)
+    if len(args) > 1:
+        open(args[1], "w").write(text)
+    else:
+        sys.stdout.write(text)
+    sys.stderr.write("%d bytes of poses and sequences packed into %d bytes\n" % (raw, packed))
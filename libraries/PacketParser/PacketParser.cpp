@@ -0,0 +1,96 @@
+/*
+  PacketParser.cpp - ArbotiX Library for reading Dynamixel-style host packets
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "PacketParser.h"
+
+PacketParser::PacketParser(){
+    stream_ = &Serial;
+    count_ = 0;
+    frame_ = 0;
+    errors = 0;
+}
+
+void PacketParser::begin(Stream & stream){
+    stream_ = &stream;
+    count_ = 0;
+    frame_ = 0;
+}
+
+/* read everything that fits from the stream, then look for a packet. Garbage is 
+    skipped within the buffer, without waiting for more bytes to arrive. */
+int PacketParser::update(){
+    if(frame_ > 0) return status_;          // next() was not called
+    while((count_ < PACKET_BUFFER_SIZE) && (stream_->available() > 0))
+        buffer_[count_++] = stream_->read();
+    while(count_ > 0){
+        // header: ff ff id length
+        if(buffer_[0] != 0xff){
+            unsigned char * ff = (unsigned char *) memchr(buffer_, 0xff, count_);
+            drop_((ff == NULL) ? count_ : (ff - buffer_));
+            continue;
+        }
+        if(count_ < 4) return PACKET_NONE;
+        if((buffer_[1] != 0xff) || (buffer_[2] == 0xff)){
+            drop_(1);
+            continue;
+        }
+        int length = buffer_[3];
+        if((length < 2) || (length > PACKET_MAX_LENGTH)){
+            errors++;
+            drop_(2);
+            continue;
+        }
+        if(count_ < length + 4) return PACKET_NONE;
+        // id through checksum sum to 255
+        unsigned char checksum = 0;
+        for(int i=2; i<length+4; i++)
+            checksum += buffer_[i];
+        if(checksum != 255){
+            errors++;
+            // only drop the header on next(), in case a real packet starts inside
+            frame_ = 2;
+            status_ = PACKET_BAD_CHECKSUM;
+            return status_;
+        }
+        frame_ = length + 4;
+        status_ = PACKET_READY;
+        return status_;
+    }
+    return PACKET_NONE;
+}
+
+void PacketParser::next(){
+    drop_(frame_);
+    frame_ = 0;
+}
+
+/* call the handler of the first route matching our id */
+void PacketParser::dispatch(const packet_route_t * routes, unsigned char count){
+    for(int i=0; i<count; i++){
+        if((routes[i].id == id()) || (routes[i].id == PACKET_ANY_ID)){
+            routes[i].handler(*this);
+            return;
+        }
+    }
+}
+
+void PacketParser::drop_(int count){
+    count_ -= count;
+    memmove(buffer_, buffer_+count, count_);
+}
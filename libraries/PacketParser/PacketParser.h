@@ -0,0 +1,82 @@
+/*
+  PacketParser.h - ArbotiX Library for reading Dynamixel-style host packets
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef PacketParser_h
+#define PacketParser_h
+
+#include <Arduino.h>
+
+/* packet: ff ff id length ins params checksum, length = # of params + 2 */
+#define PACKET_MAX_LENGTH       145     // 143 params (RX-64 buffer size) + ins + checksum
+#define PACKET_BUFFER_SIZE      (PACKET_MAX_LENGTH + 4)
+
+/* results of update() */
+#define PACKET_NONE             0       // no complete packet yet
+#define PACKET_READY            1       // a valid packet is waiting
+#define PACKET_BAD_CHECKSUM     2       // a packet with a bad checksum is waiting, id() is valid
+
+/* matches any id in a dispatch table */
+#define PACKET_ANY_ID           0xFF
+
+class PacketParser;
+typedef void (*packet_handler_t)(PacketParser & packet);
+
+/** one entry of a dispatch table **/
+typedef struct{
+    unsigned char id;           // id to match, or PACKET_ANY_ID
+    packet_handler_t handler;   // called with the packet
+} packet_route_t;
+
+/** Pulls bytes from a stream in bulk and frames them into packets. **/
+class PacketParser
+{
+  public:
+    PacketParser();
+    void begin(Stream & stream);                // stream to read from, Serial by default
+    int update();                               // read what is available, returns PACKET_*
+    void next();                                // done with this packet, move to the next
+    void dispatch(const packet_route_t * routes, unsigned char count); // hand a ready packet to its route
+
+    unsigned char id(){ return buffer_[2]; }
+    unsigned char length(){ return buffer_[3]; }
+    unsigned char ins(){ return buffer_[4]; }
+    unsigned char * params(){ return buffer_+5; }
+    unsigned char * frame(){ return buffer_; }  // whole packet, length()+4 bytes, for forwarding
+    unsigned int errors;                        // bad checksums and lengths seen
+
+    /* to read packets:
+     *  const packet_route_t routes[] = {{253, arbotix}, {PACKET_ANY_ID, passThrough}};
+     *  parser.begin(Serial);
+     *  ...in loop():
+     *  while(parser.update() == PACKET_READY){
+     *      parser.dispatch(routes, 2);
+     *      parser.next();
+     *  }
+     */
+
+  private:
+    void drop_(int count);                      // discard bytes from the front of the buffer
+
+    Stream * stream_;
+    unsigned char buffer_[PACKET_BUFFER_SIZE];
+    int count_;                                 // bytes in buffer_
+    int frame_;                                 // bytes of the waiting packet, 0 if none
+    unsigned char status_;                      // PACKET_* of the waiting packet
+};
+#endif
@@ -0,0 +1,32 @@
+/*
+  Arduino.h - just enough of the Arduino core to build PacketParser on a PC,
+  for fuzz.cpp. Not used by sketches.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <string.h>
+#include <stddef.h>
+
+class Stream
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+};
+
+/* plays back a byte string, LIMIT is how much has "arrived" so far */
+class BufferStream : public Stream
+{
+  public:
+    const unsigned char * data;
+    long size, pos, limit;
+    BufferStream(){ data = NULL; size = pos = limit = 0; }
+    int available(){ long n = ((limit < size) ? limit : size) - pos; return (n > 0) ? n : 0; }
+    int read(){ return data[pos++]; }
+};
+
+extern BufferStream Serial;
+
+#endif
@@ -0,0 +1,147 @@
+/*
+  fuzz.cpp - host test of PacketParser: garbage, chunked delivery and throughput
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* build and run from libraries/PacketParser:
+ *  g++ -O2 -Iextras -I. extras/fuzz.cpp PacketParser.cpp -o fuzz && ./fuzz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "PacketParser.h"
+
+BufferStream Serial;
+
+/* what was sent, in order, and what came out of the parser */
+std::vector<unsigned long> sent;            // id | ins<<8 | sum of params<<16
+std::vector<unsigned long> received;
+int badSent, badReceived;
+
+unsigned long signature(int id, int ins, const unsigned char * params, int n){
+    unsigned long sum = 0;
+    for(int i=0; i<n; i++) sum = sum*31 + params[i];
+    return id | (ins<<8) | ((sum & 0xffff)<<16);
+}
+
+void handler(PacketParser & packet){
+    received.push_back(signature(packet.id(), packet.ins(), packet.params(), packet.length()-2));
+}
+const packet_route_t routes[] = {{PACKET_ANY_ID, handler}};
+
+/* append a packet, with a bad checksum if CORRUPT */
+void addPacket(std::vector<unsigned char> & s, int corrupt){
+    unsigned char params[PACKET_MAX_LENGTH];
+    int id = rand() % 0xFE;                 // 0xFF is never an id
+    int n = rand() % 40;
+    int ins = rand() & 0xff;
+    unsigned char checksum = id + (n+2) + ins;
+    s.push_back(0xff); s.push_back(0xff);
+    s.push_back(id); s.push_back(n+2); s.push_back(ins);
+    for(int i=0; i<n; i++){
+        params[i] = rand() & 0xff;
+        checksum += params[i];
+        s.push_back(params[i]);
+    }
+    if(corrupt){
+        s.push_back((255-checksum) ^ 0x5a);
+        badSent++;
+    }else{
+        s.push_back(255-checksum);
+        sent.push_back(signature(id, ins, params, n));
+    }
+}
+
+/* feed S to a parser in chunks of 1 to MAX_CHUNK bytes, returns bytes parsed per second */
+double run(std::vector<unsigned char> & s, int max_chunk){
+    PacketParser parser;
+    int status;
+    Serial.data = &s[0];
+    Serial.size = s.size();
+    Serial.pos = Serial.limit = 0;
+    parser.begin(Serial);
+    received.clear();
+    badReceived = 0;
+    clock_t start = clock();
+    while(Serial.pos < Serial.size){
+        Serial.limit += 1 + rand() % max_chunk;
+        while((status = parser.update()) != PACKET_NONE){
+            if(status == PACKET_READY)
+                parser.dispatch(routes, 1);
+            else
+                badReceived++;
+            parser.next();
+        }
+    }
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    return (secs > 0) ? s.size() / secs : 0;
+}
+
+/* packets that came out in order, as a longest common subsequence would find them */
+int matched(){
+    size_t j = 0;
+    int count = 0;
+    for(size_t i=0; i<received.size(); i++){
+        // a lost packet is skipped, spurious ones from garbage are ignored
+        size_t k = j;
+        while((k < sent.size()) && (k < j+4) && (sent[k] != received[i])) k++;
+        if((k < sent.size()) && (sent[k] == received[i])){
+            count++;
+            j = k+1;
+        }
+    }
+    return count;
+}
+
+int main(){
+    std::vector<unsigned char> s;
+    int failed = 0;
+    srand(1);
+
+    // clean stream, every packet must come through
+    for(int i=0; i<20000; i++)
+        addPacket(s, 0);
+    double rate = run(s, 64);
+    printf("clean:   %d sent, %d received, %.0f bytes/s (%.0f packets/s)\n", 
+        (int) sent.size(), matched(), rate, rate*sent.size()/s.size());
+    if(matched() != (int) sent.size()) failed = 1;
+
+    // garbage between packets, some corrupt packets, byte at a time and chunked
+    s.clear();
+    sent.clear();
+    badSent = 0;
+    for(int i=0; i<20000; i++){
+        int garbage = rand() % 8;
+        for(int j=0; j<garbage; j++)
+            s.push_back((rand()%4 == 0) ? 0xff : (rand() & 0xff));
+        addPacket(s, (rand()%20) == 0);
+    }
+    int chunks[] = {1, 7, 64, PACKET_BUFFER_SIZE};
+    for(int c=0; c<4; c++){
+        run(s, chunks[c]);
+        int m = matched();
+        printf("garbage: chunks of 1-%d, %d of %d received, %d bad checksums (%d sent)\n",
+            chunks[c], m, (int) sent.size(), badReceived, badSent);
+        // a false header in the garbage can swallow the odd packet, no more
+        if(m < (int) sent.size() * 999 / 1000) failed = 1;
+    }
+
+    printf(failed ? "FAILED\n" : "passed\n");
+    return failed;
+}
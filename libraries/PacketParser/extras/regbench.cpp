@@ -0,0 +1,230 @@
+/*
+  regbench.cpp - host timing of the ros firmware's register dispatch, the 
+  reg_table lookup against the if/else chain it replaced
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* build and run from libraries/PacketParser:
+ *  g++ -O2 -I"../../ArbotiX Sketches/ros" extras/regbench.cpp -o regbench && ./regbench
+ *
+ * Hardware is stubbed out (analogRead() returns at once), so this times the 
+ * dispatch alone. A PC only shows the relative cost of the two shapes, an AVR 
+ * pays more per comparison and per FLASH read, time it there for absolutes.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#define PROGMEM
+#define pgm_read_byte(addr)     (*(const unsigned char *)(addr))
+#define ERR_NONE                0
+#define ERR_INSTRUCTION         64
+#include "ros.h"
+
+/* stand-ins for the hardware and the rest of the sketch */
+volatile unsigned char PINA, PINB, PINC, PIND, UBRR1L;
+volatile unsigned char sink;
+unsigned char ret_level = 1;
+unsigned char alarm_led = 0;
+int servo_vals[10];
+int pins[32];
+int analogRead(int ch){ return ch*100; }
+void scan(){ sink++; }
+int userRead(int addr){ return 0; }
+int userWrite(int addr, unsigned char v){ return ERR_INSTRUCTION; }
+void writeDigital(int pin, unsigned char v){ pins[pin] = v; }
+int writeServo(int s, unsigned char v){
+  if(s >= 20) return 0;
+  if(s%2 == 0) servo_vals[s/2] = v;
+  else servo_vals[s/2] += (v<<8);
+  return 1;
+}
+unsigned char readDigital(int port){
+  switch(port){
+    case 0: return PINB;
+    case 1: return PIND;
+    case 2: return PINC;
+    default: return PINA;
+  }
+}
+
+/* the if/else chain, as it was before reg_table */
+unsigned char chainRead(int addr){
+  unsigned char v = 0;
+  if(addr == REG_MODEL_NUMBER_L){ 
+    v = 44;
+  }else if(addr == REG_MODEL_NUMBER_H){
+    v = 1;
+  }else if(addr == REG_VERSION){
+    v = 0;
+  }else if(addr == REG_ID){
+    v = 253;
+  }else if(addr == REG_BAUD_RATE){
+    v = 34;
+  }else if(addr == REG_DIGITAL_IN0){
+    v = PINB;
+  }else if(addr == REG_DIGITAL_IN1){
+    v = PIND;
+  }else if(addr == REG_DIGITAL_IN2){
+    v = PINC;
+  }else if(addr == REG_DIGITAL_IN3){
+    v = PINA;
+  }else if(addr == REG_RETURN_LEVEL){
+    v = ret_level;
+  }else if(addr == REG_ALARM_LED){
+    v = alarm_led;
+  }else if(addr < REG_SERVO_BASE){
+    int x = analogRead(addr-REG_ANA_BASE)>>2;
+    x += analogRead(addr-REG_ANA_BASE)>>2;
+    x += analogRead(addr-REG_ANA_BASE)>>2;
+    x += analogRead(addr-REG_ANA_BASE)>>2;
+    v = x/4;
+  }else if(addr < REG_MOVING){
+    v = 0;      
+  }else{
+    v = userRead(addr);  
+  } 
+  return v;
+}
+unsigned char chainWrite(int addr, unsigned char v){
+  if(addr < REG_BAUD_RATE){
+    return ERR_INSTRUCTION;
+  }else if(addr == REG_BAUD_RATE){
+    UBRR1L = v;
+  }else if(addr < REG_RESCAN){
+    return ERR_INSTRUCTION;
+  }else if(addr == REG_RESCAN){
+    scan();
+  }else if(addr == REG_RETURN_LEVEL){
+    ret_level = v;
+  }else if(addr == REG_ALARM_LED){
+    alarm_led = v;
+  }else if(addr < REG_SERVO_BASE){
+    return ERR_INSTRUCTION;
+  }else if(addr < REG_MOVING){
+    if(!writeServo(addr - REG_SERVO_BASE, v)) return ERR_INSTRUCTION;
+  }else if(addr == REG_MOVING){
+    return ERR_INSTRUCTION;
+  }else if(addr < REG_RESERVED){
+    writeDigital(addr - REG_DIGITAL_OUT0, v);
+  }else{
+    int ret = userWrite(addr, v);
+    if(ret > ERR_NONE) return ret;
+  }
+  return ERR_NONE;
+}
+
+/* the reg_table dispatch, as readRegister()/handleWrite() in ros.ino */
+unsigned char tableRead(int addr){
+  unsigned char type = RT_NONE;
+  unsigned char arg = 0;
+  if(addr < REG_RESERVED){
+    type = pgm_read_byte(&reg_table[addr].type);
+    arg = pgm_read_byte(&reg_table[addr].arg);
+  }
+  if(!(type & RT_R))
+    return userRead(addr);
+  switch(type & RT_TYPE){
+    case RT_DIGITAL_IN:
+      return readDigital(arg);
+    case RT_RETURN_LEVEL:
+      return ret_level;
+    case RT_ALARM_LED:
+      return alarm_led;
+    case RT_ANALOG:
+      {
+        int x = analogRead(arg)>>2;
+        x += analogRead(arg)>>2;
+        x += analogRead(arg)>>2;
+        x += analogRead(arg)>>2;
+        return x/4;
+      }
+    case RT_SERVO:
+      return 0;
+    default:
+      return arg;
+  }
+}
+unsigned char tableWrite(int addr, unsigned char v){
+  if(addr >= REG_RESERVED){
+    int ret = userWrite(addr, v);
+    if(ret > ERR_NONE) return ret;
+    return ERR_NONE;
+  }
+  unsigned char type = pgm_read_byte(&reg_table[addr].type);
+  unsigned char arg = pgm_read_byte(&reg_table[addr].arg);
+  if(!(type & RT_W))
+    return ERR_INSTRUCTION;
+  switch(type & RT_TYPE){
+    case RT_BAUD: UBRR1L = v; break;
+    case RT_RESCAN: scan(); break;
+    case RT_RETURN_LEVEL: ret_level = v; break;
+    case RT_ALARM_LED: alarm_led = v; break;
+    case RT_SERVO: if(!writeServo(arg, v)) return ERR_INSTRUCTION; break;
+    case RT_DIGITAL_OUT: writeDigital(arg, v); break;
+  }
+  return ERR_NONE;
+}
+
+typedef unsigned char (*read_fn)(int);
+typedef unsigned char (*write_fn)(int, unsigned char);
+/* volatile, so the compiler can't fold the dispatch into the loop */
+read_fn volatile reads[2] = {chainRead, tableRead};
+write_fn volatile writes[2] = {chainWrite, tableWrite};
+
+#define PASSES      200000
+#define ADDRESSES   (REG_RESERVED+1)    // every register, and one user register
+
+double timeReads(read_fn f){
+  clock_t start = clock();
+  for(long p=0; p<PASSES; p++)
+    for(int a=0; a<ADDRESSES; a++)
+      sink += f((a < REG_RESERVED) ? a : REG_USER);
+  return 1e9 * (clock() - start) / CLOCKS_PER_SEC / ((double) PASSES * ADDRESSES);
+}
+double timeWrites(write_fn f){
+  clock_t start = clock();
+  for(long p=0; p<PASSES; p++)
+    for(int a=REG_BAUD_RATE; a<ADDRESSES; a++)
+      if(a != REG_RESCAN)               // scan() talks to the bus, leave it out
+        sink += f((a < REG_RESERVED) ? a : REG_USER, a);
+  return 1e9 * (clock() - start) / CLOCKS_PER_SEC / ((double) PASSES * (ADDRESSES - REG_BAUD_RATE - 1));
+}
+
+int main(){
+  int failed = 0;
+  // both must agree before their speed means anything
+  for(int a=0; a<ADDRESSES; a++){
+    int addr = (a < REG_RESERVED) ? a : REG_USER;
+    // the chain read unused addresses 9-15 as analog channels -9 to -3, the 
+    //  table hands them to userRead() like any other unreadable address
+    if((addr <= REG_DIGITAL_IN3) || (addr > REG_RESCAN)){
+      if(chainRead(addr) != tableRead(addr)){
+        printf("read of %d differs: chain %d, table %d\n", addr, chainRead(addr), tableRead(addr));
+        failed = 1;
+      }
+    }
+    if((addr != REG_RESCAN) && (chainWrite(addr, 0) != tableWrite(addr, 0))){
+      printf("write of %d differs: chain %d, table %d\n", addr, chainWrite(addr, 0), tableWrite(addr, 0));
+      failed = 1;
+    }
+  }
+  printf("read:  chain %.1f ns/register, table %.1f ns/register\n", timeReads(reads[0]), timeReads(reads[1]));
+  printf("write: chain %.1f ns/register, table %.1f ns/register\n", timeWrites(writes[0]), timeWrites(writes[1]));
+  printf(failed ? "FAILED\n" : "passed\n");
+  return failed;
+}
@@ -0,0 +1,107 @@
+/*
+  TaskLoop.cpp - ArbotiX Library for cooperative, deadline-based main loops
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "TaskLoop.h"
+
+TaskLoop::TaskLoop(){
+    tasks_ = NULL;
+    count_ = 0;
+    max_ = 0;
+}
+
+void TaskLoop::begin(task_t * tasks, unsigned char max){
+    tasks_ = tasks;
+    max_ = (max > TASK_MAX) ? TASK_MAX : max;
+    count_ = 0;
+}
+
+/* add a task, returns its index or -1 if full */
+int TaskLoop::add(task_fn_t run, unsigned int period, unsigned int budget, unsigned char priority){
+    if(count_ >= max_) return -1;
+    int i = count_++;
+    task_t * t = tasks_+i;
+    t->run = run;
+    t->period = period;
+    t->budget = budget;
+    t->priority = priority;
+    t->deadline = micros();
+    t->runs = 0;
+    t->lastTime = t->maxTime = t->jitter = 0;
+    t->missed = t->overruns = 0;
+    return i;
+}
+
+/* change how often a task runs, its next deadline is one new period away */
+void TaskLoop::setPeriod(int index, unsigned int period){
+    tasks_[index].period = period;
+    tasks_[index].deadline = micros() + period*1000UL;
+}
+
+/* run each due task once, highest priority first, equal priorities in the order added */
+int TaskLoop::update(){
+    unsigned int done = 0;                      // bit i = task i looked at this pass
+    int ran = 0;
+    for(;;){
+        // pick the most important task not yet looked at
+        int i, best = -1;
+        for(i=0; i<count_; i++){
+            if(done & (1U<<i)) continue;
+            if((best < 0) || (tasks_[i].priority > tasks_[best].priority))
+                best = i;
+        }
+        if(best < 0) return ran;
+        done |= (1U<<best);
+        task_t * t = tasks_+best;
+        unsigned long start = micros();
+        unsigned long late = start - t->deadline;
+        if(t->period == 0){
+            // due every pass, keep the deadline close so micros() wrapping can't strand it
+            t->deadline = start;
+        }else{
+            if((long) late < 0) continue;       // not due yet
+            unsigned long period = t->period*1000UL;
+            if(late > t->jitter)
+                t->jitter = (late > 65535UL) ? 65535 : late;
+            t->deadline += period;
+            if(late >= period){
+                // a period or more behind: count it and don't run a burst to catch up
+                t->missed += late/period;
+                t->deadline = start + period;
+            }
+        }
+        t->run();
+        unsigned long time = micros() - start;
+        t->lastTime = (time > 65535UL) ? 65535 : time;
+        if(t->lastTime > t->maxTime)
+            t->maxTime = t->lastTime;
+        if((t->budget > 0) && (time > t->budget))
+            t->overruns++;
+        t->runs++;
+        ran++;
+    }
+}
+
+void TaskLoop::resetStats(){
+    for(int i=0; i<count_; i++){
+        task_t * t = tasks_+i;
+        t->runs = 0;
+        t->lastTime = t->maxTime = t->jitter = 0;
+        t->missed = t->overruns = 0;
+    }
+}
@@ -0,0 +1,76 @@
+/*
+  TaskLoop.h - ArbotiX Library for cooperative, deadline-based main loops
+  Copyright (c) 2008-2012 Michael E. Ferguson.  All right reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TaskLoop_h
+#define TaskLoop_h
+
+#include <Arduino.h>
+
+#define TASK_MAX        16      // tasks a TaskLoop can hold
+
+typedef void (*task_fn_t)();
+
+/** a task and its statistics, storage is supplied by the sketch **/
+typedef struct{
+    task_fn_t run;
+    unsigned int period;        // ms between deadlines, 0 = every pass
+    unsigned int budget;        // us a run should take, 0 = no limit
+    unsigned char priority;     // higher runs first within a pass
+    unsigned long deadline;     // micros() the next run is due
+    // statistics, cleared by resetStats()
+    unsigned long runs;
+    unsigned int lastTime;      // us taken by the last run
+    unsigned int maxTime;       // us taken by the longest run
+    unsigned int jitter;        // us of the worst start past a deadline
+    unsigned int missed;        // deadlines skipped, a whole period late
+    unsigned int overruns;      // runs longer than budget
+} task_t;
+
+/** Runs due tasks from loop(), in order of priority. Tasks must return 
+    quickly, a long task delays every other one. **/
+class TaskLoop
+{
+  public:
+    TaskLoop();
+    void begin(task_t * tasks, unsigned char max);
+    int add(task_fn_t run, unsigned int period, unsigned int budget = 0, unsigned char priority = 0);
+    void setPeriod(int index, unsigned int period);
+    int update();                               // run everything due, returns # of tasks run
+    void resetStats();
+
+    task_t * task(int index){ return tasks_+index; }
+    unsigned char count(){ return count_; }
+
+    /* to adopt a piece at a time, move work out of loop() into tasks:
+     *  task_t task_storage[3];
+     *  tasks.begin(task_storage, 3);
+     *  tasks.add(readHost, 0, 500, 2);      // every pass, 500us budget
+     *  tasks.add(updatePID, 33, 200, 1);    // 30Hz
+     *  ...in loop():
+     *  tasks.update();
+     *  // anything not yet moved still runs here
+     */
+
+  private:
+    task_t * tasks_;
+    unsigned char count_;
+    unsigned char max_;
+};
+
+#endif